@@ -0,0 +1,28 @@
+#!/usr/bin/perl -w
+
+use strict;
+
+my @facets = ();
+my $normal = "";
+my @vertices = ();
+
+while(<>) {
+	if (/facet normal\s+(.*\S)/) {
+		$normal = $1;
+		@vertices = ();
+	} elsif (/vertex\s+(.*\S)/) {
+		push @vertices, $1;
+	} elsif (/endfacet/) {
+		# start with the smallest vertex, keeping the orientation
+		my $first = 0;
+		for my $i (1 .. $#vertices) {
+			if ($vertices[$i] lt $vertices[$first]) { $first = $i; }
+		}
+		@vertices = (@vertices[$first .. $#vertices], @vertices[0 .. $first - 1]);
+		push @facets, join(" | ", $normal, @vertices);
+	}
+}
+
+foreach (sort @facets) {
+	print $_, "\n";
+}
@@ -2,463 +2,69 @@
 
 /* coordinates used: x to the right, y to the back, z to the top */
 
-#include <vips/vips.h>
+#include "imgseq2stl.h"
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <bsd/string.h>
+#include <zlib.h>
+#include <zstd.h>
 
-/* we need only 6 different surface normals, only working on cubes */
-typedef enum {
-	nrm_front,
-	nrm_back,
-	nrm_left,
-	nrm_right,
-	nrm_up,
-	nrm_down
-} normals_t;
-
-typedef uint64_t point_t; /* 20 bits x, 20 bits y, 20 bits z */
-
-/* data for one triangle */
-struct triangle {
-	normals_t normal;
-	point_t a;
-	point_t b;
-	point_t c;
-};
+/* number of triangles compressed together into one gzip member or zstd frame */
+#define BLOCKTRIANGLES 65536
 
-/* out object */
-struct object {
-	size_t size; /* how many triangles are alloc'ed for us */
-	size_t bytes; /* size in bytes alloc'ed for us */
-	size_t free; /* first unused triangle */
-	struct triangle triangles[];
-};
+/* bytes of pages of a multi-page file decoded together */
+#define PAGEBLOCKBYTES (64*1024*1024)
 
-/* thread worker job */
+/* output compression */
 typedef enum {
-	work_finished,	/* thread has finished */
-	work_fblrxy,	/* front back left right x y */
-	work_z		/* z */
-} work_t;
+	compress_none,
+	compress_gzip,
+	compress_zstd
+} compress_t;
 
-/* thread job */
-struct job {
+/* output compression job, one block of triangles */
+struct block {
 	GThread *id;
-	volatile work_t work;
-	struct object *object;
-	int z;
-	VipsImage *image1;
-	VipsImage *image2;
-	uint8_t *refcnt1;
-	uint8_t *refcnt2;
+	compress_t compress;
+	struct triangle *triangles;
+	size_t size;
+	int count;	/* triangles dumped */
+	void *data;	/* compressed data, NULL on error */
+	size_t bytes;	/* size of compressed data */
 };
 
 /* collect all data from all threads in Fractal */
-struct object *Fractal = NULL;
-
-/* pack a point into point_t format */
-point_t packpoint(int x, int y, int z)
-{
-	return ((uint64_t) x) | (((uint64_t) y) << 20) | (((uint64_t) z) << 40);
-}
-
-/* resize a data structure, return NULL on error */
-struct object *resize(struct object *object, unsigned long int numtriangles)
-{
-	unsigned long int newsize = 0;
-
-	if (NULL == object) {
-		/* allocate size info and fill it */
-		object = malloc(sizeof(struct object));
-		object->bytes = sizeof(struct object);
-		object->size = 0;
-		object->free = 0;
-	}
-	newsize = sizeof(struct object) + numtriangles * sizeof(struct triangle);
-	object = realloc(object, newsize);
-	if (object->size < numtriangles) {
-		/* need to initialise the new ones */
-		memset(&object->triangles[object->size], 0xff, (numtriangles - object->size) * sizeof(struct triangle));
-	}
-	object->size = numtriangles;
-	object->bytes = newsize;
-	return object;
-}
-
-/* combine two object data structures */
-struct object *objcat(struct object *dst, struct object *src)
-{
-	if (!src->free) return dst;
-	if (dst->size <= (dst->free + src->free)) {
-		dst = resize(dst, 2 * (dst->free + src->free));
-	}
-	memcpy(&dst->triangles[dst->free], &src->triangles[0], src->free * sizeof(struct triangle));
-	dst->free += src->free;
-	return dst;
-}
-
-/* add bottom surface */
-struct object *addbottom(struct object *object, VipsImage *image, int z)
-{
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int w, h, x, y;
-
-	w = vips_image_get_width(image);
-	h = vips_image_get_height(image);
-	region = vips_region_new(image);
-	for(y = 0; y < h; y++) {
-		rect.left = 0;
-		rect.top = y;
-		rect.width = w;
-		rect.height = 1;
-		if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-		for(x = 0; x < w; x++) {
-			if (*VIPS_REGION_ADDR(region, x, y)) {
-				if (0xff == *VIPS_REGION_ADDR(region, x, y)) {
-					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-					object->triangles[object->free].a = packpoint(x,   y,   z);
-					object->triangles[object->free].b = packpoint(x,   y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y,   z);
-					object->triangles[object->free++].normal = nrm_down;
-					object->triangles[object->free].a = packpoint(x,   y+1, z);
-					object->triangles[object->free].b = packpoint(x+1, y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y,   z);
-					object->triangles[object->free++].normal = nrm_down;
-				} else {
-					fprintf(stderr, "warning: pixel neither black nor white @ (%d, %d, %d)\n", x, y, z);
-				}
-			}
-		}
-	}
-	g_object_unref(region);
-	return object;
-}
-
-/* add outer front surface */
-struct object *addfront(struct object *object, VipsImage *image, int z)
-{
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int w, x;
-
-	w = vips_image_get_width(image);
-	region = vips_region_new(image);
-	rect.left = 0;
-	rect.top = 0;
-	rect.width = w;
-	rect.height = 1;
-	if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-	for(x = 0; x < w; x++) {
-		if (*VIPS_REGION_ADDR(region, x, 0)) {
-			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-			object->triangles[object->free].a = packpoint(x,   0,   z+1);
-			object->triangles[object->free].b = packpoint(x,   0,   z);
-			object->triangles[object->free].c = packpoint(x+1, 0,   z);
-			object->triangles[object->free++].normal = nrm_front;
-			object->triangles[object->free].a = packpoint(x,   0,   z+1);
-			object->triangles[object->free].b = packpoint(x+1, 0,   z);
-			object->triangles[object->free].c = packpoint(x+1, 0,   z+1);
-			object->triangles[object->free++].normal = nrm_front;
-		}
-	}
-	g_object_unref(region);
-	return object;
-}
-
-/* add outer back surface */
-struct object *addback(struct object *object, VipsImage *image, int z)
-{
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int w, h, x;
-
-	w = vips_image_get_width(image);
-	h = vips_image_get_height(image);
-	region = vips_region_new(image);
-	rect.left = 0;
-	rect.top = h-1;
-	rect.width = w;
-	rect.height = 1;
-	if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-	for(x = 0; x < w; x++) {
-		if (*VIPS_REGION_ADDR(region, x, h-1)) {
-			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-			object->triangles[object->free].a = packpoint(x,   h, z);
-			object->triangles[object->free].b = packpoint(x,   h, z+1);
-			object->triangles[object->free].c = packpoint(x+1, h, z);
-			object->triangles[object->free++].normal = nrm_back;
-			object->triangles[object->free].a = packpoint(x,   h, z+1);
-			object->triangles[object->free].b = packpoint(x+1, h, z+1);
-			object->triangles[object->free].c = packpoint(x+1, h, z);
-			object->triangles[object->free++].normal = nrm_back;
-		}
-	}
-	g_object_unref(region);
-	return object;
-}
-
-/* add inner front and back surfaces */
-struct object *addx(struct object *object, VipsImage *image, int z)
-{
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int w, h, x, y;
-
-	w = vips_image_get_width(image);
-	h = vips_image_get_height(image);
-	region = vips_region_new(image);
-	for(y = 0; y < h-1; y++) {
-		rect.left = 0;
-		rect.top = y;
-		rect.width = w;
-		rect.height = 2;
-		if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-		for(x = 0; x < w; x++) {
-			if (!*VIPS_REGION_ADDR(region, x, y)) {
-				if (*VIPS_REGION_ADDR(region, x, y+1)) {
-					/* add front surface for voxel in behind row */
-					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-					object->triangles[object->free].a = packpoint(x,   y+1, z+1);
-					object->triangles[object->free].b = packpoint(x,   y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z);
-					object->triangles[object->free++].normal = nrm_front;
-					object->triangles[object->free].a = packpoint(x,   y+1, z+1);
-					object->triangles[object->free].b = packpoint(x+1, y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z+1);
-					object->triangles[object->free++].normal = nrm_front;
-				}
-			} else {
-				if (!*VIPS_REGION_ADDR(region, x, y+1)) {
-					/* add back surface for voxel in front row */
-					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-					object->triangles[object->free].a = packpoint(x,   y+1, z);
-					object->triangles[object->free].b = packpoint(x,   y+1, z+1);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z);
-					object->triangles[object->free++].normal = nrm_back;
-					object->triangles[object->free].a = packpoint(x,   y+1, z+1);
-					object->triangles[object->free].b = packpoint(x+1, y+1, z+1);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z);
-					object->triangles[object->free++].normal = nrm_back;
-				}
-			}
-		}
-	}
-	g_object_unref(region);
-	return object;
-}
-
-/* add outer left surface */
-struct object *addleft(struct object *object, VipsImage *image, int z)
-{
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int h, y;
-
-	h = vips_image_get_height(image);
-	region = vips_region_new(image);
-	rect.left = 0;
-	rect.top = 0;
-	rect.width = 1;
-	rect.height = h;
-	if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-	for(y = 0; y < h; y++) {
-		if (*VIPS_REGION_ADDR(region, 0, y)) {
-			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-			object->triangles[object->free].a = packpoint(0, y,   z);
-			object->triangles[object->free].b = packpoint(0, y,   z+1);
-			object->triangles[object->free].c = packpoint(0, y+1, z);
-			object->triangles[object->free++].normal = nrm_left;
-			object->triangles[object->free].a = packpoint(0, y,   z+1);
-			object->triangles[object->free].b = packpoint(0, y+1, z+1);
-			object->triangles[object->free].c = packpoint(0, y+1, z);
-			object->triangles[object->free++].normal = nrm_left;
-		}
-	}
-	g_object_unref(region);
-	return object;
-}
+struct triangle *Fractal = NULL;
+size_t Fractalsize = 0; /* how many triangles are alloc'ed */
+size_t Fractalfree = 0; /* first unused triangle */
 
-/* add outer right surface */
-struct object *addright(struct object *object, VipsImage *image, int z)
+/* triangle sink for the converter, copies triangles into Fractal */
+void collect(void *userdata, const struct triangle *triangles, size_t count)
 {
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int w, h, y;
-
-	w = vips_image_get_width(image);
-	h = vips_image_get_height(image);
-	region = vips_region_new(image);
-	rect.left = w-1;
-	rect.top = 0;
-	rect.width = 1;
-	rect.height = h;
-	if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-	for(y = 0; y < h; y++) {
-		if (*VIPS_REGION_ADDR(region, w-1, y)) {
-			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-			object->triangles[object->free].a = packpoint(w, y,   z);
-			object->triangles[object->free].b = packpoint(w, y+1, z);
-			object->triangles[object->free].c = packpoint(w, y,   z+1);
-			object->triangles[object->free++].normal = nrm_right;
-			object->triangles[object->free].a = packpoint(w, y,   z+1);
-			object->triangles[object->free].b = packpoint(w, y+1, z);
-			object->triangles[object->free].c = packpoint(w, y+1, z+1);
-			object->triangles[object->free++].normal = nrm_right;
+	if (Fractalfree + count > Fractalsize) {
+		Fractalsize = MAX(2 * Fractalsize, Fractalfree + count);
+		Fractal = realloc(Fractal, Fractalsize * sizeof(struct triangle));
+		if (NULL == Fractal) {
+			fprintf(stderr, "Can't allocate triangles\n");
+			exit(1);
 		}
 	}
-	g_object_unref(region);
-	return object;
+	memcpy(&Fractal[Fractalfree], triangles, count * sizeof(struct triangle));
+	Fractalfree += count;
 }
 
-/* add inner left and right surfaces */
-struct object *addy(struct object *object, VipsImage *image, int z)
-{
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int w, h, x, y;
-
-	w = vips_image_get_width(image);
-	h = vips_image_get_height(image);
-	region = vips_region_new(image);
-	for(x = 0; x < w-1; x++) {
-		rect.left = x;
-		rect.top = 0;
-		rect.width = 2;
-		rect.height = h;
-		if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-		for(y = 0; y < h; y++) {
-			if (!*VIPS_REGION_ADDR(region, x, y)) {
-				if (*VIPS_REGION_ADDR(region, x+1, y)) {
-					/* add left surface for voxel in 2nd row */
-					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-					object->triangles[object->free].a = packpoint(x+1, y,   z);
-					object->triangles[object->free].b = packpoint(x+1, y,   z+1);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z);
-					object->triangles[object->free++].normal = nrm_left;
-					object->triangles[object->free].a = packpoint(x+1, y,   z+1);
-					object->triangles[object->free].b = packpoint(x+1, y+1, z+1);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z);
-					object->triangles[object->free++].normal = nrm_left;
-				}
-			} else {
-				if (!*VIPS_REGION_ADDR(region, x+1, y)) {
-					/* add right surface for voxel in first row */
-					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-					object->triangles[object->free].a = packpoint(x+1, y,   z);
-					object->triangles[object->free].b = packpoint(x+1, y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y,   z+1);
-					object->triangles[object->free++].normal = nrm_right;
-					object->triangles[object->free].a = packpoint(x+1, y,   z+1);
-					object->triangles[object->free].b = packpoint(x+1, y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z+1);
-					object->triangles[object->free++].normal = nrm_right;
-				}
-			}
-		}
-	}
-	g_object_unref(region);
-	return object;
-}
-
-/* add inner top and bottom surfaces */
-struct object *addz(struct object *object, VipsImage *image1, VipsImage *image2, int z)
-{
-	VipsRegion *region1 = NULL;
-	VipsRegion *region2 = NULL;
-	VipsRect rect;
-	int w, h, x, y;
-
-	w = vips_image_get_width(image1);
-	h = vips_image_get_height(image1);
-	if (vips_image_get_width(image2) != w) vips_error_exit("Images have different width");
-	if (vips_image_get_height(image2) != h) vips_error_exit("Images have different height");
-	region1 = vips_region_new(image1);
-	region2 = vips_region_new(image2);
-	for(y = 0; y < h; y++) {
-		for(x = 0; x < w; x++) {
-			rect.left = 0;
-			rect.top = y;
-			rect.width = w;
-			rect.height = 1;
-			if (vips_region_prepare(region1, &rect) < 0) vips_error_exit("Can't prepare region");
-			if (vips_region_prepare(region2, &rect) < 0) vips_error_exit("Can't prepare region");
-			if (!*VIPS_REGION_ADDR(region1, x, y)) {
-				if (*VIPS_REGION_ADDR(region2, x, y)) {
-					/* add bottom surface for upper object */
-					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-					object->triangles[object->free].a = packpoint(x,   y,   z);
-					object->triangles[object->free].b = packpoint(x,   y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y,   z);
-					object->triangles[object->free++].normal = nrm_down;
-					object->triangles[object->free].a = packpoint(x,   y+1, z);
-					object->triangles[object->free].b = packpoint(x+1, y+1, z);
-					object->triangles[object->free].c = packpoint(x+1, y,   z);
-					object->triangles[object->free++].normal = nrm_down;
-				}
-			} else {
-				if (!*VIPS_REGION_ADDR(region2, x, y)) {
-					/* add top surface for lower object */
-					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-					object->triangles[object->free].a = packpoint(x,   y+1, z);
-					object->triangles[object->free].b = packpoint(x,   y,   z);
-					object->triangles[object->free].c = packpoint(x+1, y,   z);
-					object->triangles[object->free++].normal = nrm_up;
-					object->triangles[object->free].a = packpoint(x,   y+1, z);
-					object->triangles[object->free].b = packpoint(x+1, y,   z);
-					object->triangles[object->free].c = packpoint(x+1, y+1, z);
-					object->triangles[object->free++].normal = nrm_up;
-				}
-			}
-		}
-	}
-	g_object_unref(region1);
-	g_object_unref(region2);
-	return object;
-}
-
-/* add top surface */
-struct object *addtop(struct object *object, VipsImage *image, int z)
-{
-	VipsRegion *region = NULL;
-	VipsRect rect;
-	int w, h, x, y;
-
-	w = vips_image_get_width(image);
-	h = vips_image_get_height(image);
-	region = vips_region_new(image);
-	for(y = 0; y < h; y++) {
-		rect.left = 0;
-		rect.top = y;
-		rect.width = w;
-		rect.height = 1;
-		if (vips_region_prepare(region, &rect) < 0) vips_error_exit("Can't prepare region");
-		for(x = 0; x < w; x++) {
-			if (*VIPS_REGION_ADDR(region, x, y)) {
-				if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
-				object->triangles[object->free].a = packpoint(x,   y+1, z+1);
-				object->triangles[object->free].b = packpoint(x,   y,   z+1);
-				object->triangles[object->free].c = packpoint(x+1, y,   z+1);
-				object->triangles[object->free++].normal = nrm_up;
-				object->triangles[object->free].a = packpoint(x,   y+1, z+1);
-				object->triangles[object->free].b = packpoint(x+1, y,   z+1);
-				object->triangles[object->free].c = packpoint(x+1, y+1, z+1);
-				object->triangles[object->free++].normal = nrm_up;
-			}
-		}
-	}
-	g_object_unref(region);
-	return object;
-}
-
-/* dump all triangles as ASCII STL */
-void dumptriangles_ascii(FILE *file, struct triangle *triangles, size_t size)
+/* dump all triangles as ASCII STL, returns the number of triangles dumped */
+static int dumptriangles_ascii(FILE *file, struct triangle *triangles, size_t size)
 {
 	int i;
 	int count = 0;
@@ -497,86 +103,136 @@ void dumptriangles_ascii(FILE *file, struct triangle *triangles, size_t size)
 			fprintf(file, "endfacet\n");
 		}
 	}
-	fprintf(stderr, "%d triangles dumped\n", count);
+	return count;
 }
 
-/* gets started as a new thread */
-void *jobs_worker(void *data)
+/* compress a buffer into one complete gzip member or zstd frame, returns NULL on error */
+static void *compressbuffer(compress_t compress, const void *in, size_t inlen, size_t *outlen)
 {
-	struct job *job = data;
-
-	switch (job->work) {
-		case work_fblrxy:
-			job->object = addfront(job->object, job->image1, job->z);
-			job->object = addback(job->object, job->image1, job->z);
-			job->object = addleft(job->object, job->image1, job->z);
-			job->object = addright(job->object, job->image1, job->z);
-			job->object = addx(job->object, job->image1, job->z);
-			job->object = addy(job->object, job->image1, job->z);
+	void *out = NULL;
+
+	switch (compress) {
+		case compress_gzip: {
+			z_stream strm;
+
+			memset(&strm, 0, sizeof(strm));
+			/* 16 added to windowBits writes a gzip header and trailer */
+			if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) break;
+			*outlen = deflateBound(&strm, inlen);
+			out = malloc(*outlen);
+			if (NULL != out) {
+				strm.next_in = (Bytef *) in;
+				strm.avail_in = inlen;
+				strm.next_out = out;
+				strm.avail_out = *outlen;
+				if (deflate(&strm, Z_FINISH) == Z_STREAM_END) {
+					*outlen = strm.total_out;
+				} else {
+					free(out);
+					out = NULL;
+				}
+			}
+			deflateEnd(&strm);
 			break;
-		case work_z:
-			job->object = addz(job->object, job->image2, job->image1, job->z);
+		}
+		case compress_zstd: {
+			size_t ret;
+
+			*outlen = ZSTD_compressBound(inlen);
+			out = malloc(*outlen);
+			if (NULL == out) break;
+			ret = ZSTD_compress(out, *outlen, in, inlen, 3);
+			if (ZSTD_isError(ret)) {
+				free(out);
+				out = NULL;
+			} else {
+				*outlen = ret;
+			}
 			break;
+		}
 		default:
 			break;
 	}
-	vips_thread_shutdown();
-	job->work = work_finished;
-	return NULL;
+	return out;
 }
 
-/* collect results and cleanup after finished job, runs in main thread */
-void jobs_end(struct job *job)
+/* write a compressed string to the output file */
+static void writecompressed(FILE *file, compress_t compress, const char *text)
 {
-	/* wait for thread to end */
-	(void) g_thread_join(job->id);
-	job->id = NULL;
-	/* copy triangles */
-	Fractal = objcat(Fractal, job->object);
-	free(job->object);
-	job->object = NULL;
-	/* do reference counting */
-	if (job->image1 && (++(*job->refcnt1) > 2)) {
-		g_object_unref(job->image1);
+	void *data;
+	size_t bytes;
+
+	data = compressbuffer(compress, text, strlen(text), &bytes);
+	if (NULL == data) {
+		fprintf(stderr, "Can't compress output\n");
+		exit(1);
 	}
-	if (job->image2 && (++(*job->refcnt2) > 2)) {
-		g_object_unref(job->image2);
+	if (fwrite(data, 1, bytes, file) != bytes) {
+		fprintf(stderr, "Can't write output file\n");
+		exit(1);
 	}
+	free(data);
 }
 
-/* wait for a free job, runs in main thread */
-int jobs_wait(struct job jobs[], int num)
+/* format and compress one block of triangles, gets started as a new thread */
+static void *block_worker(void *data)
 {
-	int i;
-
-	while(1) {
-		for(i = 0; i < num; i++) {
-			if (work_finished == jobs[i].work) {
-				if (jobs[i].id) {
-					jobs_end(&jobs[i]);
-				}
-				return i;
-			}
-		}
-		sleep(1); /* wait a bit to give threads more time to finish */
+	struct block *block = data;
+	FILE *file;
+	char *text = NULL;
+	size_t textlen = 0;
+
+	block->data = NULL;
+	file = open_memstream(&text, &textlen);
+	if (NULL == file) return NULL;
+	block->count = dumptriangles_ascii(file, block->triangles, block->size);
+	if (0 == fclose(file)) {
+		block->data = compressbuffer(block->compress, text, textlen, &block->bytes);
 	}
-	return -1; /* never reached */
+	free(text);
+	return NULL;
 }
 
-/* start a new thread, runs in main thread */
-void jobs_new(struct job *jobs, int threads, work_t work, int z, VipsImage *image1, VipsImage *image2, uint8_t *refcnt1, uint8_t *refcnt2)
+/* dump all triangles as compressed ASCII STL, blocks are compressed in
+ * parallel and written in order as concatenated gzip members or zstd frames,
+ * returns the number of triangles dumped */
+static int dumptriangles_compressed(FILE *file, compress_t compress, int threads, struct triangle *triangles, size_t size)
 {
-	int j;
-
-	j = jobs_wait(jobs, threads);
-	jobs[j].work = work;
-	jobs[j].object = resize(NULL, 10);
-	jobs[j].z = z;
-	jobs[j].image1 = image1;
-	jobs[j].image2 = image2;
-	jobs[j].refcnt1 = refcnt1;
-	jobs[j].refcnt2 = refcnt2;
-	jobs[j].id = vips_g_thread_new("imgseq2stl", &jobs_worker, &jobs[j]);
+	struct block *blocks;
+	size_t numblocks, started = 0, k;
+	int count = 0;
+
+	blocks = calloc(threads, sizeof(struct block));
+	if (NULL == blocks) {
+		fprintf(stderr, "Can't allocate blocks\n");
+		exit(1);
+	}
+	numblocks = (size + BLOCKTRIANGLES - 1) / BLOCKTRIANGLES;
+	for(k = 0; k < numblocks; k++) {
+		/* keep all threads busy with the next blocks */
+		for(; (started < numblocks) && (started < k + threads); started++) {
+			struct block *block = &blocks[started % threads];
+			block->compress = compress;
+			block->triangles = &triangles[started * BLOCKTRIANGLES];
+			block->size = MIN(size - started * BLOCKTRIANGLES, BLOCKTRIANGLES);
+			block->id = vips_g_thread_new("imgseq2stl", &block_worker, block);
+		}
+		/* write the oldest block */
+		(void) g_thread_join(blocks[k % threads].id);
+		blocks[k % threads].id = NULL;
+		if (NULL == blocks[k % threads].data) {
+			fprintf(stderr, "Can't compress output\n");
+			exit(1);
+		}
+		if (fwrite(blocks[k % threads].data, 1, blocks[k % threads].bytes, file) != blocks[k % threads].bytes) {
+			fprintf(stderr, "Can't write output file\n");
+			exit(1);
+		}
+		free(blocks[k % threads].data);
+		count += blocks[k % threads].count;
+	}
+	free(blocks);
+	return count;
 }
 
 int main(int argc, char *argv[])
@@ -587,26 +243,48 @@ int main(int argc, char *argv[])
 		{ "first", 1, NULL, 'f' },
 		{ "last", 1, NULL, 'l' },
 		{ "threads", 1, NULL, 't' },
+		{ "compress", 1, NULL, 'c' },
+		{ "min-component-voxels", 1, NULL, 'm' },
+		{ "exterior-only", 0, NULL, 'e' },
+		{ "raw", 1, NULL, 'r' },
+		{ "pages", 0, NULL, 'p' },
 		{ 0, 0, 0, 0 }
 	};
-	char para_input[80];
-	char para_output[80];
+	char para_input[PATH_MAX];
+	char para_output[PATH_MAX];
 	int para_first = 0;
 	int para_last = 0;
 	int para_threads = 1;
-	VipsImage *image1 = NULL;
-	VipsImage *image2 = NULL;
-	uint8_t *imgrefcnts = NULL; /* use counters for VipsImages, only used in main thread */
+	int para_autothreads = 0;
+	char para_compress[80];
+	compress_t compress = compress_none;
+	long long para_minvoxels = 0;
+	int para_exterior = 0;
+	int para_rawwidth = 0;
+	int para_rawheight = 0;
+	int para_pages = 0;
+	VipsSource *source = NULL; /* multi-page input file, NULL otherwise */
+	VipsImage *block = NULL; /* decoded pages blockfirst to blocklast */
+	VipsImage *pages;
+	int blockfirst = 0, blocklast = -1, pageheight = 0, numpages;
+	unsigned char *raw = NULL; /* mapped raw input file, NULL otherwise */
+	size_t rawsize = 0, rawlayer = 0;
+	struct stat st;
+	int fd;
+	struct imgseq2stl_components components;
+	VipsImage *image = NULL;
+	struct imgseq2stl *ctx;
 	int z;
-	char s[80];
+	char s[PATH_MAX];
+	char line[PATH_MAX + 16]; /* solid/endsolid line for compressed output */
 	FILE *file;
-	struct job *jobs;
 	int i;
 
 	s[0] = 0;
 	/* parameter parsing */
 	para_input[0] = 0;
 	para_output[0] = 0;
+	strlcpy(para_compress, "none", sizeof(para_compress));
 	while(1) {
 		int i;
 		i = getopt_long(argc, argv, "", longoptions, NULL);
@@ -625,7 +303,26 @@ int main(int argc, char *argv[])
 				para_last = strtol(optarg, NULL, 0);
 				break;
 			case 't':
-				para_threads = strtol(optarg, NULL, 0);
+				if (0 == strcmp(optarg, "auto")) {
+					para_autothreads = 1;
+				} else {
+					para_threads = strtol(optarg, NULL, 0);
+				}
+				break;
+			case 'c':
+				strlcpy(para_compress, optarg, sizeof(para_compress));
+				break;
+			case 'm':
+				para_minvoxels = strtoll(optarg, NULL, 0);
+				break;
+			case 'e':
+				para_exterior = 1;
+				break;
+			case 'r':
+				if (2 != sscanf(optarg, "%dx%d", &para_rawwidth, &para_rawheight)) para_rawwidth = -1;
+				break;
+			case 'p':
+				para_pages = 1;
 				break;
 		}
 	}
@@ -637,25 +334,63 @@ int main(int argc, char *argv[])
 		if (para_last <= para_first) { fprintf(stderr, "--last must be > --first\n"); abort = 1; }
 		if (0 == strlen(para_input)) { fprintf(stderr, "--input must be set\n"); abort = 1; }
 		if (0 == strlen(para_output)) { fprintf(stderr, "--output must be set\n"); abort = 1; }
-		if (para_threads < 1) { fprintf(stderr, "--threads must be >= 1\n"); abort = 1; }
+		if (para_threads < 1) { fprintf(stderr, "--threads must be >= 1 or auto\n"); abort = 1; }
 		if (para_threads > 200) { fprintf(stderr, "--threads must be <= 200\n"); abort = 1; }
+		if ((para_rawwidth < 0) || (para_rawheight < 0)) { fprintf(stderr, "--raw must be <width>x<height>\n"); abort = 1; }
+		if (para_rawwidth && para_pages) { fprintf(stderr, "--raw and --pages can't be used together\n"); abort = 1; }
+		if (para_minvoxels < 0) { fprintf(stderr, "--min-component-voxels must be >= 0\n"); abort = 1; }
+		if (0 == strcmp(para_compress, "gzip")) {
+			compress = compress_gzip;
+		} else if (0 == strcmp(para_compress, "zstd")) {
+			compress = compress_zstd;
+		} else if (0 != strcmp(para_compress, "none")) {
+			fprintf(stderr, "--compress must be zstd, gzip or none\n"); abort = 1;
+		}
 		if (abort) exit(1);
 	}
 
 	if (VIPS_INIT (argv[0])) vips_error_exit("unable to start VIPS");
 
-	/* allocate worker threads */
-	jobs = calloc(para_threads, sizeof(struct job));
-	if (NULL == jobs) {
-		fprintf(stderr, "Can't allocate jobs\n");
+	/* output compression uses the same number of threads */
+	if (para_autothreads) para_threads = imgseq2stl_auto_threads();
+
+	/* converter collecting all triangles in Fractal */
+	ctx = imgseq2stl_new(para_autothreads ? 0 : para_threads, &collect, NULL);
+	if (NULL == ctx) {
+		fprintf(stderr, "Can't allocate converter\n");
 		exit(1);
 	}
+	if (para_minvoxels && (imgseq2stl_set_min_component_voxels(ctx, para_minvoxels) < 0)) {
+		vips_error_exit("Can't enable component analysis");
+	}
+	if (para_exterior && (imgseq2stl_set_exterior_only(ctx) < 0)) {
+		vips_error_exit("Can't enable exterior analysis");
+	}
 
-	/* allocate reference counters for VipsImages */
-	imgrefcnts = calloc(para_last - para_first + 1, 1);
-	if (NULL == imgrefcnts) {
-		fprintf(stderr, "Can't allocate imgrefcnt\n");
-		exit(1);
+	/* a multi-page file is opened once, its pages are decoded in blocks */
+	if (para_pages) {
+		source = vips_source_new_from_file(para_input);
+		if (NULL == source) vips_error_exit("Can't open file '%s'", para_input);
+	}
+	/* a raw file is mapped once, every layer points into it */
+	if (para_rawwidth) {
+		rawlayer = (size_t) para_rawwidth * para_rawheight;
+		fd = open(para_input, O_RDONLY);
+		if ((fd < 0) || (fstat(fd, &st) < 0)) {
+			fprintf(stderr, "Can't open file '%s'\n", para_input);
+			exit(1);
+		}
+		rawsize = st.st_size;
+		if (rawsize < (size_t) (para_last + 1) * rawlayer) {
+			fprintf(stderr, "File '%s' is too short for layer %d\n", para_input, para_last);
+			exit(1);
+		}
+		raw = mmap(NULL, rawsize, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (MAP_FAILED == raw) {
+			fprintf(stderr, "Can't map file '%s'\n", para_input);
+			exit(1);
+		}
 	}
 
 	/* output file */
@@ -666,45 +401,82 @@ int main(int argc, char *argv[])
 	}
 
 	/* allocate space for final object */
-	Fractal = resize(NULL, 1024*1024);
+	Fractalsize = 1024*1024;
+	Fractal = malloc(Fractalsize * sizeof(struct triangle));
+	if (NULL == Fractal) {
+		fprintf(stderr, "Can't allocate triangles\n");
+		exit(1);
+	}
 
 	for(z = para_first; z <= para_last; z++) {
 		fprintf(stderr, "\rWorking on layer %d", z); fflush(stderr);
-		snprintf(s, sizeof(s), para_input, z);
-		image1 = vips_image_new_from_file(s, NULL);
-		if (NULL == image1) vips_error_exit("Can't load file '%s'", s);
-		if (z == para_first) {
-			/* first layer needs to have bottom added */
-			Fractal = addbottom(Fractal, image1, z);
-			imgrefcnts[z - para_first]++;
+		/* decoding happens when the worker threads use the layer */
+		if (raw) {
+			/* raw layers follow each other without gaps */
+			image = vips_image_new_from_memory(raw + z * rawlayer, rawlayer,
+				para_rawwidth, para_rawheight, 1, VIPS_FORMAT_UCHAR);
+			if (NULL == image) vips_error_exit("Can't load layer %d of file '%s'", z, para_input);
+		} else if (source) {
+			/* the workers must not share the source, so the pages are
+			 * decoded here, in order and many at once */
+			if (z > blocklast) {
+				numpages = 1;
+				if (block) {
+					numpages = MAX(1, PAGEBLOCKBYTES / (vips_image_get_width(block) * (size_t) pageheight));
+					g_object_unref(block);
+				}
+				numpages = MIN(numpages, para_last + 1 - z);
+				pages = vips_image_new_from_source(source, "", "page", z, "n", numpages, NULL);
+				if (NULL == pages) vips_error_exit("Can't load page %d of file '%s'", z, para_input);
+				block = vips_image_copy_memory(pages);
+				g_object_unref(pages);
+				if (NULL == block) vips_error_exit("Can't load page %d of file '%s'", z, para_input);
+				pageheight = vips_image_get_page_height(block);
+				blockfirst = z;
+				blocklast = z + numpages - 1;
+			}
+			if (vips_extract_area(block, &image, 0, (z - blockfirst) * pageheight,
+			    vips_image_get_width(block), pageheight, NULL) < 0) {
+				vips_error_exit("Can't load page %d of file '%s'", z, para_input);
+			}
 		} else {
-			/* rest of the layers need z added */
-			jobs_new(jobs, para_threads, work_z, z, image1, image2, &imgrefcnts[z - para_first], &imgrefcnts[z - para_first - 1]);
-		}
-		/* combine all jobs which need only one image */
-		jobs_new(jobs, para_threads, work_fblrxy, z, image1, NULL, &imgrefcnts[z - para_first], NULL);
-		image2 = image1;
-		if (z == para_last) {
-			/* last layer needs top added */
-			Fractal = addtop(Fractal, image1, z);
-			imgrefcnts[z - para_first]++;
+			snprintf(s, sizeof(s), para_input, z);
+			image = vips_image_new_from_file(s, NULL);
+			if (NULL == image) vips_error_exit("Can't load file '%s'", s);
 		}
+		if (imgseq2stl_push_image(ctx, z, image) < 0) vips_error_exit("Can't add layer %d", z);
 	}
+	if (block) g_object_unref(block);
+	if (source) g_object_unref(source);
 	/* wait for all threads to end and collect results */
-	for(i = 0; i < para_threads; i++) {
-		if (jobs[i].id) {
-			jobs_end(&jobs[i]);
-		}
-	}
+	if (imgseq2stl_finish(ctx) < 0) vips_error_exit("Can't finish object");
 	fprintf(stderr, "\r                             \r"); fflush(stderr);
-
-	fprintf(file, "solid %s\n", para_output);
-	dumptriangles_ascii(file, Fractal->triangles, Fractal->size);
-	fprintf(file, "endsolid %s\n", para_output);
-
-	/* sanity checking VipsImage use counters */
-	for(i = 0; i < (para_last - para_first + 1); i++) {
-		if (imgrefcnts[i] != 3) fprintf(stderr, "refcnt %d %d\n", i, imgrefcnts[i]);
+	if (para_exterior && (0 == imgseq2stl_get_components(ctx, &components))) {
+		fprintf(stderr, "%zu triangles of enclosed cavities dropped\n", components.cavitytriangles);
+	}
+	if (para_minvoxels && (0 == imgseq2stl_get_components(ctx, &components))) {
+		fprintf(stderr, "%lu components, largest %" PRIu64 " voxels, %lu kept, %" PRIu64 " voxels and %zu triangles dropped\n",
+			components.components, components.largest, components.kept, components.droppedvoxels, components.droppedtriangles);
+	}
+	imgseq2stl_free(ctx);
+	/* all layers are freed now */
+	if (raw) munmap(raw, rawsize);
+
+	if (compress_none == compress) {
+		fprintf(file, "solid %s\n", para_output);
+		i = dumptriangles_ascii(file, Fractal, Fractalfree);
+		fprintf(file, "endsolid %s\n", para_output);
+	} else {
+		snprintf(line, sizeof(line), "solid %s\n", para_output);
+		writecompressed(file, compress, line);
+		i = dumptriangles_compressed(file, compress, para_threads, Fractal, Fractalfree);
+		snprintf(line, sizeof(line), "endsolid %s\n", para_output);
+		writecompressed(file, compress, line);
+	}
+	fprintf(stderr, "%d triangles dumped\n", i);
+	if (fclose(file)) {
+		fprintf(stderr, "Can't write output file\n");
+		exit(1);
 	}
 
 	vips_shutdown();
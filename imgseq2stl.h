@@ -0,0 +1,93 @@
+/* library interface to convert a sequence of images into triangles */
+
+/* coordinates used: x to the right, y to the back, z to the top */
+
+#ifndef IMGSEQ2STL_H
+#define IMGSEQ2STL_H
+
+#include <vips/vips.h>
+
+#include <stdint.h>
+
+/* we need only 6 different surface normals, only working on cubes */
+typedef enum {
+	nrm_front,
+	nrm_back,
+	nrm_left,
+	nrm_right,
+	nrm_up,
+	nrm_down
+} normals_t;
+
+typedef uint64_t point_t; /* 20 bits x, 20 bits y, 20 bits z */
+
+/* unpack the coordinates of a point_t */
+#define POINT_X(p) ((p) & 0xfffff)
+#define POINT_Y(p) (((p) >> 20) & 0xfffff)
+#define POINT_Z(p) (((p) >> 40) & 0xfffff)
+
+/* data for one triangle */
+struct triangle {
+	normals_t normal;
+	point_t a;
+	point_t b;
+	point_t c;
+};
+
+/* triangle sink, gets called with batches of finished triangles in the
+ * thread which pushes the layers, the triangles are only valid during the call */
+typedef void (*imgseq2stl_sink_t)(void *userdata, const struct triangle *triangles, size_t count);
+
+/* connected component statistics */
+struct imgseq2stl_components {
+	unsigned long components;	/* number of parts not connected to each other */
+	unsigned long kept;		/* parts with at least the minimum number of voxels */
+	uint64_t voxels;		/* solid voxels in all parts */
+	uint64_t largest;		/* voxels in the largest part */
+	uint64_t droppedvoxels;		/* voxels in dropped parts */
+	size_t droppedtriangles;	/* triangles of dropped parts */
+	size_t cavitytriangles;		/* triangles facing enclosed cavities */
+};
+
+/* converter state, opaque to library users */
+struct imgseq2stl;
+
+/* number of CPUs this process can use, honouring affinity and cgroup limits */
+int imgseq2stl_auto_threads(void);
+
+/* create a converter using threads worker threads, with 0 threads the number
+ * of CPUs is used and the work per thread adapts to the measured run time,
+ * returns NULL on error */
+struct imgseq2stl *imgseq2stl_new(int threads, imgseq2stl_sink_t sink, void *userdata);
+
+/* enable connected component analysis, must be called before the first
+ * layer is pushed, parts with less than minvoxels voxels are dropped, all
+ * triangles are held back until finish, returns -1 on error */
+int imgseq2stl_set_min_component_voxels(struct imgseq2stl *ctx, uint64_t minvoxels);
+
+/* enable exterior analysis, must be called before the first layer is pushed,
+ * surfaces facing empty space not connected to the outside are dropped, all
+ * triangles are held back until finish, returns -1 on error */
+int imgseq2stl_set_exterior_only(struct imgseq2stl *ctx);
+
+/* add layer z, the layers must be pushed in consecutive order from bottom
+ * to top, takes over the reference to image also when failing, returns -1 on
+ * error, after a failed layer all further layers fail too */
+int imgseq2stl_push_image(struct imgseq2stl *ctx, int z, VipsImage *image);
+
+/* add layer z from a 8 bit buffer of width * height pixels, non-zero pixels
+ * are solid, the buffer is copied, returns -1 on error */
+int imgseq2stl_push_layer(struct imgseq2stl *ctx, int z, const uint8_t *buffer, int width, int height);
+
+/* add top surface of the last layer and wait for all triangles to be
+ * delivered to the sink, returns -1 if any layer has failed */
+int imgseq2stl_finish(struct imgseq2stl *ctx);
+
+/* get connected component statistics after finish, returns -1 if
+ * component and exterior analysis are not enabled */
+int imgseq2stl_get_components(struct imgseq2stl *ctx, struct imgseq2stl_components *stats);
+
+/* free the converter, finishes it first if needed */
+void imgseq2stl_free(struct imgseq2stl *ctx);
+
+#endif
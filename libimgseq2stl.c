@@ -0,0 +1,1676 @@
+/* library to convert a sequence of images into triangles */
+
+/* coordinates used: x to the right, y to the back, z to the top */
+
+#include "imgseq2stl.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+
+/* most triangles handed to the sink at once */
+#define SINKTRIANGLES 65536
+
+/* most pieces of work one job can do with automatic threads */
+#define MAXBATCH 64
+
+/* run time in microseconds aimed for one job with automatic threads */
+#define JOBTIME 50000
+
+/* layers which may be open at once for every thread, the jobs are started
+ * early when more are pushed, so big batches do not hold many layers */
+#define LAYERSPERTHREAD 4
+
+/* set in a label map entry when it is a finished part, not a label of the
+ * next layer */
+#define FINISHED 0x80000000u
+
+/* connected components of a triangle, kept out of struct triangle so the
+ * sink does not get them */
+struct tag {
+	uint32_t component; /* connected component of the voxel it belongs to */
+	uint32_t cavity; /* empty space in front of the surface, only used by exterior analysis */
+};
+
+/* out object */
+struct object {
+	size_t size; /* how many triangles are alloc'ed for us */
+	size_t bytes; /* size in bytes alloc'ed for us */
+	size_t free; /* first unused triangle */
+	int error; /* set when an image could not be read */
+	struct tag *tags; /* same size as triangles, NULL without component analysis */
+	struct object *next; /* next held back object */
+	struct triangle triangles[];
+};
+
+/* run of solid or empty pixels in one row of a layer */
+struct run {
+	int x0;		/* first pixel of the run */
+	int x1;		/* first pixel after the run */
+	uint32_t id;	/* label of the connected part in the layer */
+	uint8_t solid;	/* 0 for empty space */
+};
+
+/* union find entry of a connected part, for the runs of a layer while they
+ * are found and for the labels of the layers being joined */
+struct label {
+	uint64_t voxels;	/* voxels of the part if it is a root, 0 for empty space */
+	uint32_t parent;
+	uint8_t solid;		/* 0 for empty space */
+	uint8_t outside;	/* empty space connected to the outside */
+};
+
+/* all runs of one layer, used for connected component analysis */
+struct runs {
+	int w;
+	int h;
+	size_t *rows;		/* runs of row y are runs[rows[y]] to runs[rows[y+1]-1] */
+	struct run *runs;
+	size_t num;		/* runs used */
+	size_t size;		/* runs alloc'ed */
+	struct label *labels;	/* connected parts within the layer, joined with the layers around */
+	uint32_t numlabels;
+};
+
+/* one layer image, shared by the jobs working on it */
+struct layer {
+	VipsImage *image;
+	int z;
+	struct layer *next; /* layer above, NULL for the last one */
+	struct runs *runs; /* NULL without component analysis or until found */
+	int runsready; /* 1 when the runs are found, -1 when that failed, protected by ctx->lock */
+	uint8_t users; /* the layer is freed when the last user is done */
+};
+
+/* labels of a finished layer, kept until finish to resolve the triangle tags */
+struct labelmap {
+	uint32_t *map;	/* label of the layer above, or FINISHED and the part */
+	uint32_t num;
+};
+
+/* finished connected part, no longer touching the layers being joined */
+struct component {
+	uint64_t voxels;	/* 0 for empty space */
+	uint8_t outside;	/* empty space connected to the outside */
+};
+
+/* thread worker job */
+typedef enum {
+	work_runs,	/* runs and connected parts of a layer */
+	work_bottom,	/* bottom of the first layer */
+	work_fblrxy,	/* front back left right x y */
+	work_z		/* z */
+} work_t;
+
+/* one piece of work, one layer for one job type */
+struct work {
+	work_t work;
+	int z;
+	struct layer *layer1;
+	struct layer *layer2;
+};
+
+/* thread job */
+struct job {
+	GThread *id;
+	struct imgseq2stl *ctx;
+	unsigned long seq;	/* jobs are numbered in the order they are started */
+	int finished;	/* thread has finished or never started, protected by ctx->lock */
+	gint64 time;	/* microseconds the thread was running */
+	struct object *object;
+	int numwork;
+	struct work work[MAXBATCH];
+};
+
+/* result of a finished job waiting for the results of earlier jobs */
+struct parked {
+	struct parked *next;
+	unsigned long seq;
+	struct object *object;
+};
+
+/* converter state */
+struct imgseq2stl {
+	int threads;
+	struct job *jobs;
+	int error;	/* set when a layer failed, reported by finish */
+	GMutex lock;	/* protects finished of all jobs and runsready of all layers */
+	GCond cond;	/* signalled when a job has finished */
+	GCond runscond;	/* broadcast when the runs of a layer are found */
+	int adaptive;	/* adapt batch to the measured job run time */
+	int batch;	/* pieces of work per job */
+	int pending;	/* job collecting work before it is started, -1 if none */
+	unsigned long jobseq;	/* number of the next job */
+	unsigned long emitseq;	/* number of the next job to emit */
+	struct parked *parked;	/* results waiting for earlier jobs, sorted by number */
+	imgseq2stl_sink_t sink;
+	void *userdata;
+	struct layer *last; /* most recently pushed layer, NULL before the first one and after finish */
+	int numlayers;	/* layers not freed yet */
+	int maxlayers;	/* more layers wait for running jobs */
+	/* connected component analysis, the parts of each layer are found in
+	 * the workers and joined with the layer below in layer order */
+	int analysis;		/* component or exterior analysis enabled */
+	uint64_t minvoxels;	/* 0 if disabled */
+	int exterior;		/* drop surfaces of enclosed cavities */
+	struct layer *joined;	/* last layer joined with the one below */
+	struct layer *joinnext;	/* next layer to join, NULL if not pushed yet */
+	int firstz;		/* layer of labelmaps[0] */
+	struct labelmap *labelmaps; /* one for every layer joined with the one above */
+	size_t numlabelmaps;
+	size_t sizelabelmaps;
+	struct component *components; /* finished parts */
+	size_t numcomponents;
+	size_t sizecomponents;
+	struct object *deferred; /* triangles held back until all components are known */
+	struct object **deferredlast; /* link to the last held back object */
+	struct imgseq2stl_components stats;
+};
+
+/* pack a point into point_t format */
+static point_t packpoint(int x, int y, int z)
+{
+	return ((uint64_t) x) | (((uint64_t) y) << 20) | (((uint64_t) z) << 40);
+}
+
+/* resize a data structure, return NULL if a new one can't be allocated,
+ * a failed growth sets the error of the object */
+static struct object *resize(struct object *object, unsigned long int numtriangles)
+{
+	struct object *more;
+	struct tag *tags;
+	unsigned long int newsize = 0;
+
+	if (NULL == object) {
+		/* allocate size info and fill it */
+		object = malloc(sizeof(struct object));
+		if (NULL == object) {
+			vips_error("imgseq2stl", "can't allocate triangles");
+			return NULL;
+		}
+		object->bytes = sizeof(struct object);
+		object->size = 0;
+		object->free = 0;
+		object->error = 0;
+		object->tags = NULL;
+		object->next = NULL;
+	}
+	newsize = sizeof(struct object) + numtriangles * sizeof(struct triangle);
+	more = realloc(object, newsize);
+	if (NULL == more) {
+		/* a failed shrink leaves the old memory usable */
+		if (numtriangles <= object->size) return object;
+		vips_error("imgseq2stl", "can't allocate triangles");
+		object->error = 1;
+		/* the callers write the next triangles unchecked, keep them
+		 * inside the old memory, the content is useless now anyway */
+		object->free = 0;
+		return object;
+	}
+	object = more;
+	if (object->tags) {
+		tags = realloc(object->tags, numtriangles * sizeof(struct tag));
+		if (tags) {
+			object->tags = tags;
+		} else if (numtriangles > object->size) {
+			vips_error("imgseq2stl", "can't allocate tags");
+			object->error = 1;
+			free(object->tags);
+			object->tags = NULL;
+		}
+	}
+	if (object->size < numtriangles) {
+		/* need to initialise the new ones */
+		memset(&object->triangles[object->size], 0xff, (numtriangles - object->size) * sizeof(struct triangle));
+	}
+	object->size = numtriangles;
+	object->bytes = newsize;
+	return object;
+}
+
+/* append triangles to an object data structure, sets its error if they
+ * don't fit */
+static struct object *addtriangles(struct object *dst, const struct object *src)
+{
+	size_t count = src->free;
+
+	if (!count) return dst;
+	if (dst->size <= (dst->free + count)) {
+		dst = resize(dst, 2 * (dst->free + count));
+	}
+	if (dst->error) return dst;
+	memcpy(&dst->triangles[dst->free], src->triangles, count * sizeof(struct triangle));
+	if (src->tags) {
+		if (NULL == dst->tags) dst->tags = malloc(dst->size * sizeof(struct tag));
+		if (NULL == dst->tags) {
+			vips_error("imgseq2stl", "can't allocate tags");
+			dst->error = 1;
+			return dst;
+		}
+		memcpy(&dst->tags[dst->free], src->tags, count * sizeof(struct tag));
+	}
+	dst->free += count;
+	return dst;
+}
+
+/* free an object with its tags */
+static void freeobject(struct object *object)
+{
+	if (NULL == object) return;
+	free(object->tags);
+	free(object);
+}
+
+/* add bottom surface */
+static struct object *addbottom(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int w, h, x, y;
+
+	w = vips_image_get_width(image);
+	h = vips_image_get_height(image);
+	region = vips_region_new(image);
+	for(y = 0; y < h; y++) {
+		rect.left = 0;
+		rect.top = y;
+		rect.width = w;
+		rect.height = 1;
+		if (vips_region_prepare(region, &rect) < 0) {
+			object->error = 1;
+			break;
+		}
+		for(x = 0; x < w; x++) {
+			if (*VIPS_REGION_ADDR(region, x, y)) {
+				if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+				object->triangles[object->free].a = packpoint(x,   y,   z);
+				object->triangles[object->free].b = packpoint(x,   y+1, z);
+				object->triangles[object->free].c = packpoint(x+1, y,   z);
+				object->triangles[object->free++].normal = nrm_down;
+				object->triangles[object->free].a = packpoint(x,   y+1, z);
+				object->triangles[object->free].b = packpoint(x+1, y+1, z);
+				object->triangles[object->free].c = packpoint(x+1, y,   z);
+				object->triangles[object->free++].normal = nrm_down;
+			}
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add outer front surface */
+static struct object *addfront(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int w, x;
+
+	w = vips_image_get_width(image);
+	region = vips_region_new(image);
+	rect.left = 0;
+	rect.top = 0;
+	rect.width = w;
+	rect.height = 1;
+	if (vips_region_prepare(region, &rect) < 0) {
+		object->error = 1;
+		g_object_unref(region);
+		return object;
+	}
+	for(x = 0; x < w; x++) {
+		if (*VIPS_REGION_ADDR(region, x, 0)) {
+			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+			object->triangles[object->free].a = packpoint(x,   0,   z+1);
+			object->triangles[object->free].b = packpoint(x,   0,   z);
+			object->triangles[object->free].c = packpoint(x+1, 0,   z);
+			object->triangles[object->free++].normal = nrm_front;
+			object->triangles[object->free].a = packpoint(x,   0,   z+1);
+			object->triangles[object->free].b = packpoint(x+1, 0,   z);
+			object->triangles[object->free].c = packpoint(x+1, 0,   z+1);
+			object->triangles[object->free++].normal = nrm_front;
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add outer back surface */
+static struct object *addback(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int w, h, x;
+
+	w = vips_image_get_width(image);
+	h = vips_image_get_height(image);
+	region = vips_region_new(image);
+	rect.left = 0;
+	rect.top = h-1;
+	rect.width = w;
+	rect.height = 1;
+	if (vips_region_prepare(region, &rect) < 0) {
+		object->error = 1;
+		g_object_unref(region);
+		return object;
+	}
+	for(x = 0; x < w; x++) {
+		if (*VIPS_REGION_ADDR(region, x, h-1)) {
+			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+			object->triangles[object->free].a = packpoint(x,   h, z);
+			object->triangles[object->free].b = packpoint(x,   h, z+1);
+			object->triangles[object->free].c = packpoint(x+1, h, z);
+			object->triangles[object->free++].normal = nrm_back;
+			object->triangles[object->free].a = packpoint(x,   h, z+1);
+			object->triangles[object->free].b = packpoint(x+1, h, z+1);
+			object->triangles[object->free].c = packpoint(x+1, h, z);
+			object->triangles[object->free++].normal = nrm_back;
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add inner front and back surfaces */
+static struct object *addx(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int w, h, x, y;
+
+	w = vips_image_get_width(image);
+	h = vips_image_get_height(image);
+	region = vips_region_new(image);
+	for(y = 0; y < h-1; y++) {
+		rect.left = 0;
+		rect.top = y;
+		rect.width = w;
+		rect.height = 2;
+		if (vips_region_prepare(region, &rect) < 0) {
+			object->error = 1;
+			break;
+		}
+		for(x = 0; x < w; x++) {
+			if (!*VIPS_REGION_ADDR(region, x, y)) {
+				if (*VIPS_REGION_ADDR(region, x, y+1)) {
+					/* add front surface for voxel in behind row */
+					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+					object->triangles[object->free].a = packpoint(x,   y+1, z+1);
+					object->triangles[object->free].b = packpoint(x,   y+1, z);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z);
+					object->triangles[object->free++].normal = nrm_front;
+					object->triangles[object->free].a = packpoint(x,   y+1, z+1);
+					object->triangles[object->free].b = packpoint(x+1, y+1, z);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z+1);
+					object->triangles[object->free++].normal = nrm_front;
+				}
+			} else {
+				if (!*VIPS_REGION_ADDR(region, x, y+1)) {
+					/* add back surface for voxel in front row */
+					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+					object->triangles[object->free].a = packpoint(x,   y+1, z);
+					object->triangles[object->free].b = packpoint(x,   y+1, z+1);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z);
+					object->triangles[object->free++].normal = nrm_back;
+					object->triangles[object->free].a = packpoint(x,   y+1, z+1);
+					object->triangles[object->free].b = packpoint(x+1, y+1, z+1);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z);
+					object->triangles[object->free++].normal = nrm_back;
+				}
+			}
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add outer left surface */
+static struct object *addleft(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int h, y;
+
+	h = vips_image_get_height(image);
+	region = vips_region_new(image);
+	rect.left = 0;
+	rect.top = 0;
+	rect.width = 1;
+	rect.height = h;
+	if (vips_region_prepare(region, &rect) < 0) {
+		object->error = 1;
+		g_object_unref(region);
+		return object;
+	}
+	for(y = 0; y < h; y++) {
+		if (*VIPS_REGION_ADDR(region, 0, y)) {
+			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+			object->triangles[object->free].a = packpoint(0, y,   z);
+			object->triangles[object->free].b = packpoint(0, y,   z+1);
+			object->triangles[object->free].c = packpoint(0, y+1, z);
+			object->triangles[object->free++].normal = nrm_left;
+			object->triangles[object->free].a = packpoint(0, y,   z+1);
+			object->triangles[object->free].b = packpoint(0, y+1, z+1);
+			object->triangles[object->free].c = packpoint(0, y+1, z);
+			object->triangles[object->free++].normal = nrm_left;
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add outer right surface */
+static struct object *addright(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int w, h, y;
+
+	w = vips_image_get_width(image);
+	h = vips_image_get_height(image);
+	region = vips_region_new(image);
+	rect.left = w-1;
+	rect.top = 0;
+	rect.width = 1;
+	rect.height = h;
+	if (vips_region_prepare(region, &rect) < 0) {
+		object->error = 1;
+		g_object_unref(region);
+		return object;
+	}
+	for(y = 0; y < h; y++) {
+		if (*VIPS_REGION_ADDR(region, w-1, y)) {
+			if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+			object->triangles[object->free].a = packpoint(w, y,   z);
+			object->triangles[object->free].b = packpoint(w, y+1, z);
+			object->triangles[object->free].c = packpoint(w, y,   z+1);
+			object->triangles[object->free++].normal = nrm_right;
+			object->triangles[object->free].a = packpoint(w, y,   z+1);
+			object->triangles[object->free].b = packpoint(w, y+1, z);
+			object->triangles[object->free].c = packpoint(w, y+1, z+1);
+			object->triangles[object->free++].normal = nrm_right;
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add inner left and right surfaces */
+static struct object *addy(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int w, h, x, y;
+
+	w = vips_image_get_width(image);
+	h = vips_image_get_height(image);
+	region = vips_region_new(image);
+	for(x = 0; x < w-1; x++) {
+		rect.left = x;
+		rect.top = 0;
+		rect.width = 2;
+		rect.height = h;
+		if (vips_region_prepare(region, &rect) < 0) {
+			object->error = 1;
+			break;
+		}
+		for(y = 0; y < h; y++) {
+			if (!*VIPS_REGION_ADDR(region, x, y)) {
+				if (*VIPS_REGION_ADDR(region, x+1, y)) {
+					/* add left surface for voxel in 2nd row */
+					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+					object->triangles[object->free].a = packpoint(x+1, y,   z);
+					object->triangles[object->free].b = packpoint(x+1, y,   z+1);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z);
+					object->triangles[object->free++].normal = nrm_left;
+					object->triangles[object->free].a = packpoint(x+1, y,   z+1);
+					object->triangles[object->free].b = packpoint(x+1, y+1, z+1);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z);
+					object->triangles[object->free++].normal = nrm_left;
+				}
+			} else {
+				if (!*VIPS_REGION_ADDR(region, x+1, y)) {
+					/* add right surface for voxel in first row */
+					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+					object->triangles[object->free].a = packpoint(x+1, y,   z);
+					object->triangles[object->free].b = packpoint(x+1, y+1, z);
+					object->triangles[object->free].c = packpoint(x+1, y,   z+1);
+					object->triangles[object->free++].normal = nrm_right;
+					object->triangles[object->free].a = packpoint(x+1, y,   z+1);
+					object->triangles[object->free].b = packpoint(x+1, y+1, z);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z+1);
+					object->triangles[object->free++].normal = nrm_right;
+				}
+			}
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add inner top and bottom surfaces */
+static struct object *addz(struct object *object, VipsImage *image1, VipsImage *image2, int z)
+{
+	VipsRegion *region1 = NULL;
+	VipsRegion *region2 = NULL;
+	VipsRect rect;
+	int w, h, x, y;
+
+	w = vips_image_get_width(image1);
+	h = vips_image_get_height(image1);
+	if ((vips_image_get_width(image2) != w) || (vips_image_get_height(image2) != h)) {
+		vips_error("imgseq2stl", "images have different size");
+		object->error = 1;
+		return object;
+	}
+	region1 = vips_region_new(image1);
+	region2 = vips_region_new(image2);
+	for(y = 0; y < h; y++) {
+		rect.left = 0;
+		rect.top = y;
+		rect.width = w;
+		rect.height = 1;
+		if ((vips_region_prepare(region1, &rect) < 0) || (vips_region_prepare(region2, &rect) < 0)) {
+			object->error = 1;
+			break;
+		}
+		for(x = 0; x < w; x++) {
+			if (!*VIPS_REGION_ADDR(region1, x, y)) {
+				if (*VIPS_REGION_ADDR(region2, x, y)) {
+					/* add bottom surface for upper object */
+					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+					object->triangles[object->free].a = packpoint(x,   y,   z);
+					object->triangles[object->free].b = packpoint(x,   y+1, z);
+					object->triangles[object->free].c = packpoint(x+1, y,   z);
+					object->triangles[object->free++].normal = nrm_down;
+					object->triangles[object->free].a = packpoint(x,   y+1, z);
+					object->triangles[object->free].b = packpoint(x+1, y+1, z);
+					object->triangles[object->free].c = packpoint(x+1, y,   z);
+					object->triangles[object->free++].normal = nrm_down;
+				}
+			} else {
+				if (!*VIPS_REGION_ADDR(region2, x, y)) {
+					/* add top surface for lower object */
+					if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+					object->triangles[object->free].a = packpoint(x,   y+1, z);
+					object->triangles[object->free].b = packpoint(x,   y,   z);
+					object->triangles[object->free].c = packpoint(x+1, y,   z);
+					object->triangles[object->free++].normal = nrm_up;
+					object->triangles[object->free].a = packpoint(x,   y+1, z);
+					object->triangles[object->free].b = packpoint(x+1, y,   z);
+					object->triangles[object->free].c = packpoint(x+1, y+1, z);
+					object->triangles[object->free++].normal = nrm_up;
+				}
+			}
+		}
+	}
+	g_object_unref(region1);
+	g_object_unref(region2);
+	return object;
+}
+
+/* add top surface */
+static struct object *addtop(struct object *object, VipsImage *image, int z)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	int w, h, x, y;
+
+	w = vips_image_get_width(image);
+	h = vips_image_get_height(image);
+	region = vips_region_new(image);
+	for(y = 0; y < h; y++) {
+		rect.left = 0;
+		rect.top = y;
+		rect.width = w;
+		rect.height = 1;
+		if (vips_region_prepare(region, &rect) < 0) {
+			object->error = 1;
+			break;
+		}
+		for(x = 0; x < w; x++) {
+			if (*VIPS_REGION_ADDR(region, x, y)) {
+				if ((object->free + 2) >= object->size) object = resize(object, object->size * 2);
+				object->triangles[object->free].a = packpoint(x,   y+1, z+1);
+				object->triangles[object->free].b = packpoint(x,   y,   z+1);
+				object->triangles[object->free].c = packpoint(x+1, y,   z+1);
+				object->triangles[object->free++].normal = nrm_up;
+				object->triangles[object->free].a = packpoint(x,   y+1, z+1);
+				object->triangles[object->free].b = packpoint(x+1, y,   z+1);
+				object->triangles[object->free].c = packpoint(x+1, y+1, z+1);
+				object->triangles[object->free++].normal = nrm_up;
+			}
+		}
+	}
+	g_object_unref(region);
+	return object;
+}
+
+/* add a finished connected part, returns FINISHED and its entry, sets the
+ * error flag when no entry can be allocated, runs in main thread */
+static uint32_t component_new(struct imgseq2stl *ctx, const struct label *root)
+{
+	struct component *more;
+	size_t size;
+
+	if (ctx->numcomponents >= ctx->sizecomponents) {
+		size = MIN(MAX(1024, 2 * ctx->sizecomponents), FINISHED);
+		if (size <= ctx->sizecomponents) {
+			vips_error("imgseq2stl", "too many components");
+			ctx->error = 1;
+			return FINISHED;
+		}
+		more = realloc(ctx->components, size * sizeof(struct component));
+		if (NULL == more) {
+			vips_error("imgseq2stl", "can't allocate components");
+			ctx->error = 1;
+			return FINISHED;
+		}
+		ctx->components = more;
+		ctx->sizecomponents = size;
+	}
+	ctx->components[ctx->numcomponents].voxels = root->voxels;
+	ctx->components[ctx->numcomponents].outside = root->outside;
+	return FINISHED | ctx->numcomponents++;
+}
+
+/* find the root label of a connected part */
+static uint32_t label_find(struct label *labels, uint32_t id)
+{
+	while (labels[id].parent != id) {
+		/* path halving */
+		labels[id].parent = labels[labels[id].parent].parent;
+		id = labels[id].parent;
+	}
+	return id;
+}
+
+/* join two connected parts */
+static void label_join(struct label *labels, uint32_t id1, uint32_t id2)
+{
+	id1 = label_find(labels, id1);
+	id2 = label_find(labels, id2);
+	if (id1 == id2) return;
+	/* hang the smaller part below the bigger one */
+	if (labels[id1].voxels < labels[id2].voxels) {
+		uint32_t tmp = id1;
+		id1 = id2;
+		id2 = tmp;
+	}
+	labels[id2].parent = id1;
+	labels[id1].voxels += labels[id2].voxels;
+	labels[id1].outside |= labels[id2].outside;
+}
+
+/* join all overlapping runs of the same kind of two rows, the labels of the
+ * runs of each row start at base1 and base2 */
+static void joinrows(struct label *labels, struct runs *runs1, int y1, uint32_t base1, struct runs *runs2, int y2, uint32_t base2)
+{
+	size_t i = runs1->rows[y1];
+	size_t j = runs2->rows[y2];
+
+	while ((i < runs1->rows[y1+1]) && (j < runs2->rows[y2+1])) {
+		if ((runs1->runs[i].x0 < runs2->runs[j].x1) && (runs2->runs[j].x0 < runs1->runs[i].x1) &&
+		    (runs1->runs[i].solid == runs2->runs[j].solid)) {
+			label_join(labels, base1 + runs1->runs[i].id, base2 + runs2->runs[j].id);
+		}
+		/* advance the run which ends first */
+		if (runs1->runs[i].x1 < runs2->runs[j].x1) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+}
+
+/* find the runs of a layer and the connected parts within the layer, each
+ * part gets a label, empty runs are only needed for exterior analysis,
+ * safe to use in worker threads */
+static int findruns(struct imgseq2stl *ctx, struct layer *layer)
+{
+	VipsRegion *region = NULL;
+	VipsRect rect;
+	struct runs *runs;
+	struct run *more;
+	struct label *labels;
+	size_t i, r;
+	int w, h, x, y, x0;
+	uint8_t solid;
+
+	w = vips_image_get_width(layer->image);
+	h = vips_image_get_height(layer->image);
+	runs = calloc(1, sizeof(struct runs));
+	if (NULL == runs) {
+		vips_error("imgseq2stl", "can't allocate runs");
+		return -1;
+	}
+	layer->runs = runs;
+	runs->w = w;
+	runs->h = h;
+	runs->rows = malloc((h + 1) * sizeof(size_t));
+	if (NULL == runs->rows) {
+		vips_error("imgseq2stl", "can't allocate runs");
+		return -1;
+	}
+	region = vips_region_new(layer->image);
+	for(y = 0; y < h; y++) {
+		rect.left = 0;
+		rect.top = y;
+		rect.width = w;
+		rect.height = 1;
+		if (vips_region_prepare(region, &rect) < 0) {
+			g_object_unref(region);
+			return -1;
+		}
+		runs->rows[y] = runs->num;
+		for(x = 0; x < w; ) {
+			solid = !!*VIPS_REGION_ADDR(region, x, y);
+			x0 = x;
+			while ((x < w) && (solid == !!*VIPS_REGION_ADDR(region, x, y))) x++;
+			if (!solid && !ctx->exterior) continue;
+			if (runs->num >= runs->size) {
+				more = realloc(runs->runs, MAX(1024, 2 * runs->size) * sizeof(struct run));
+				if (NULL == more) {
+					vips_error("imgseq2stl", "can't allocate runs");
+					g_object_unref(region);
+					return -1;
+				}
+				runs->runs = more;
+				runs->size = MAX(1024, 2 * runs->size);
+			}
+			runs->runs[runs->num].x0 = x0;
+			runs->runs[runs->num].x1 = x;
+			runs->runs[runs->num].solid = solid;
+			runs->runs[runs->num].id = runs->num;
+			runs->num++;
+		}
+	}
+	runs->rows[h] = runs->num;
+	g_object_unref(region);
+	if (runs->num >= FINISHED) {
+		vips_error("imgseq2stl", "too many runs in layer %d", layer->z);
+		return -1;
+	}
+	/* one union find entry for every run while the parts are found */
+	labels = malloc(MAX(1, runs->num) * sizeof(struct label));
+	if (NULL == labels) {
+		vips_error("imgseq2stl", "can't allocate labels");
+		return -1;
+	}
+	for(y = 0; y < h; y++) {
+		for(i = runs->rows[y]; i < runs->rows[y+1]; i++) {
+			labels[i].parent = i;
+			labels[i].solid = runs->runs[i].solid;
+			labels[i].voxels = labels[i].solid ? runs->runs[i].x1 - runs->runs[i].x0 : 0;
+			/* empty space at the sides is outside */
+			labels[i].outside = !labels[i].solid &&
+				((0 == runs->runs[i].x0) || (w == runs->runs[i].x1) || (0 == y) || (h-1 == y));
+		}
+	}
+	for(y = 1; y < h; y++) {
+		joinrows(labels, runs, y, 0, runs, y-1, 0);
+	}
+	/* number the parts in the order of their roots */
+	for(i = 0; i < runs->num; i++) {
+		if (label_find(labels, i) == i) runs->runs[i].id = runs->numlabels++;
+	}
+	for(i = 0; i < runs->num; i++) {
+		r = label_find(labels, i);
+		if (r != i) runs->runs[i].id = runs->runs[r].id;
+	}
+	/* only the roots are kept, each moves down to its label */
+	for(i = 0; i < runs->num; i++) {
+		if (labels[i].parent == i) {
+			labels[runs->runs[i].id] = labels[i];
+			labels[runs->runs[i].id].parent = runs->runs[i].id;
+		}
+	}
+	runs->labels = realloc(labels, MAX(1, runs->numlabels) * sizeof(struct label));
+	if (NULL == runs->labels) runs->labels = labels;
+	return 0;
+}
+
+/* find the label of the part a voxel belongs to, UINT32_MAX if not found */
+static uint32_t findcomponent(struct runs *runs, int x, int y)
+{
+	size_t lo = runs->rows[y];
+	size_t hi = runs->rows[y+1];
+	size_t mid;
+
+	/* binary search, runs in a row are sorted by x */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (x < runs->runs[mid].x0) {
+			hi = mid;
+		} else if (x >= runs->runs[mid].x1) {
+			lo = mid + 1;
+		} else {
+			return runs->runs[mid].id;
+		}
+	}
+	return UINT32_MAX;
+}
+
+/* find the voxel a triangle belongs to and the voxel in front of it */
+static void triangle_voxels(const struct triangle *triangle, int *x, int *y, int *z, int *fx, int *fy, int *fz)
+{
+	*x = MIN(MIN(POINT_X(triangle->a), POINT_X(triangle->b)), POINT_X(triangle->c));
+	*y = MIN(MIN(POINT_Y(triangle->a), POINT_Y(triangle->b)), POINT_Y(triangle->c));
+	*z = MIN(MIN(POINT_Z(triangle->a), POINT_Z(triangle->b)), POINT_Z(triangle->c));
+	/* surfaces facing to the positive side belong to the voxel before them */
+	switch (triangle->normal) {
+		case nrm_back: (*y)--; break;
+		case nrm_right: (*x)--; break;
+		case nrm_up: (*z)--; break;
+		default: break;
+	}
+	*fx = *x;
+	*fy = *y;
+	*fz = *z;
+	/* step to the empty voxel in front of the surface */
+	switch (triangle->normal) {
+		case nrm_front: (*fy)--; break;
+		case nrm_back: (*fy)++; break;
+		case nrm_left: (*fx)--; break;
+		case nrm_right: (*fx)++; break;
+		case nrm_down: (*fz)--; break;
+		case nrm_up: (*fz)++; break;
+		default: break;
+	}
+}
+
+/* mark triangles with the label of the voxel they belong to and of the
+ * empty space they face, the voxels are in layer1 or layer2 or outside of
+ * the object, safe to use in worker threads */
+static void tagtriangles(struct object *object, size_t from, struct layer *layer1, struct layer *layer2)
+{
+	struct tag *tag;
+	struct layer *layer;
+	size_t i;
+	int x, y, z, fx, fy, fz;
+
+	if (NULL == object->tags) {
+		object->tags = malloc(object->size * sizeof(struct tag));
+		if (NULL == object->tags) {
+			vips_error("imgseq2stl", "can't allocate tags");
+			object->error = 1;
+			return;
+		}
+	}
+	for(i = from; i < object->free; i++) {
+		tag = &object->tags[i];
+		triangle_voxels(&object->triangles[i], &x, &y, &z, &fx, &fy, &fz);
+		layer = (layer2 && (layer2->z == z)) ? layer2 : layer1;
+		tag->component = findcomponent(layer->runs, x, y);
+		if ((fx < 0) || (fy < 0) || (fx >= layer->runs->w) || (fy >= layer->runs->h)) {
+			tag->cavity = UINT32_MAX;
+		} else if (layer1->z == fz) {
+			tag->cavity = findcomponent(layer1->runs, fx, fy);
+		} else if (layer2 && (layer2->z == fz)) {
+			tag->cavity = findcomponent(layer2->runs, fx, fy);
+		} else {
+			/* below the first or above the last layer */
+			tag->cavity = UINT32_MAX;
+		}
+	}
+}
+
+/* find the runs of a layer and wake up the jobs waiting for them, safe to
+ * use in worker threads */
+static void layer_findruns(struct job *job, struct layer *layer)
+{
+	int ready = 1;
+
+	/* after an error the runs are only marked as failed */
+	if (job->object->error || (findruns(job->ctx, layer) < 0)) {
+		job->object->error = 1;
+		ready = -1;
+	}
+	g_mutex_lock(&job->ctx->lock);
+	layer->runsready = ready;
+	g_cond_broadcast(&job->ctx->runscond);
+	g_mutex_unlock(&job->ctx->lock);
+}
+
+/* wait until the runs of a layer are found, returns -1 if that failed, safe
+ * to use in worker threads */
+static int layer_waitruns(struct imgseq2stl *ctx, struct layer *layer)
+{
+	int ready;
+
+	g_mutex_lock(&ctx->lock);
+	while (0 == layer->runsready) g_cond_wait(&ctx->runscond, &ctx->lock);
+	ready = layer->runsready;
+	g_mutex_unlock(&ctx->lock);
+	return ready;
+}
+
+/* gets started as a new thread */
+static void *jobs_worker(void *data)
+{
+	struct job *job = data;
+	struct work *work;
+	gint64 start;
+	size_t from;
+	int i;
+
+	start = g_get_monotonic_time();
+	for(i = 0; i < job->numwork; i++) {
+		work = &job->work[i];
+		from = job->object->free;
+		switch (work->work) {
+			case work_runs:
+				/* other jobs wait for the runs, even after an error */
+				layer_findruns(job, work->layer1);
+				continue;
+			case work_bottom:
+				if (job->object->error) continue;
+				job->object = addbottom(job->object, work->layer1->image, work->z);
+				break;
+			case work_fblrxy:
+				if (job->object->error) continue;
+				job->object = addfront(job->object, work->layer1->image, work->z);
+				job->object = addback(job->object, work->layer1->image, work->z);
+				job->object = addleft(job->object, work->layer1->image, work->z);
+				job->object = addright(job->object, work->layer1->image, work->z);
+				job->object = addx(job->object, work->layer1->image, work->z);
+				job->object = addy(job->object, work->layer1->image, work->z);
+				break;
+			case work_z:
+				if (job->object->error) continue;
+				job->object = addz(job->object, work->layer2->image, work->layer1->image, work->z);
+				break;
+			default:
+				break;
+		}
+		if (job->object->error || !job->ctx->analysis) continue;
+		/* the runs are found by this or an earlier job */
+		if ((layer_waitruns(job->ctx, work->layer1) < 0) ||
+		    (work->layer2 && (layer_waitruns(job->ctx, work->layer2) < 0))) {
+			job->object->error = 1;
+			continue;
+		}
+		tagtriangles(job->object, from, work->layer1, work->layer2);
+	}
+	vips_thread_shutdown();
+	/* wake up main thread */
+	g_mutex_lock(&job->ctx->lock);
+	job->time = g_get_monotonic_time() - start;
+	job->finished = 1;
+	g_cond_signal(&job->ctx->cond);
+	g_mutex_unlock(&job->ctx->lock);
+	return NULL;
+}
+
+/* count one finished user of a layer, frees it after the last one */
+static void layer_release(struct imgseq2stl *ctx, struct layer *layer)
+{
+	if (0 == --layer->users) {
+		ctx->numlayers--;
+		g_object_unref(layer->image);
+		if (layer->runs) {
+			free(layer->runs->rows);
+			free(layer->runs->runs);
+			free(layer->runs->labels);
+			free(layer->runs);
+		}
+		free(layer);
+	}
+}
+
+/* join the parts of a layer with the parts of the layer below, the empty
+ * space of the first layer is outside, without layer the parts of below are
+ * all finished, below gets a label map, both need their runs found, runs in
+ * main thread */
+static void joinlayer(struct imgseq2stl *ctx, struct layer *below, struct layer *layer)
+{
+	struct runs *runs1 = below ? below->runs : NULL;
+	struct runs *runs2 = layer ? layer->runs : NULL;
+	uint32_t num1 = runs1 ? runs1->numlabels : 0;
+	uint32_t num2 = runs2 ? runs2->numlabels : 0;
+	struct labelmap *labelmap = NULL;
+	struct label *labels;
+	uint32_t *map;
+	uint32_t i, r;
+	int y;
+
+	/* runsready does not change any more once it was seen set */
+	if ((below && (below->runsready <= 0)) || (layer && (layer->runsready <= 0))) {
+		vips_error("imgseq2stl", "runs of a layer to join are missing");
+		ctx->error = 1;
+		return;
+	}
+	if (below && (ctx->numlabelmaps >= ctx->sizelabelmaps)) {
+		labelmap = realloc(ctx->labelmaps, MAX(1024, 2 * ctx->sizelabelmaps) * sizeof(struct labelmap));
+		if (NULL == labelmap) {
+			vips_error("imgseq2stl", "can't allocate label maps");
+			ctx->error = 1;
+			return;
+		}
+		ctx->labelmaps = labelmap;
+		ctx->sizelabelmaps = MAX(1024, 2 * ctx->sizelabelmaps);
+	}
+	/* labels of below first, then the labels of layer */
+	labels = malloc(MAX(1, num1 + num2) * sizeof(struct label));
+	map = malloc(MAX(1, num1 + num2) * sizeof(uint32_t));
+	if ((NULL == labels) || (NULL == map)) {
+		vips_error("imgseq2stl", "can't allocate labels");
+		ctx->error = 1;
+		free(labels);
+		free(map);
+		return;
+	}
+	if (num1) memcpy(labels, runs1->labels, num1 * sizeof(struct label));
+	for(i = 0; i < num2; i++) {
+		labels[num1 + i] = runs2->labels[i];
+		labels[num1 + i].parent += num1;
+		if (NULL == below) labels[num1 + i].outside |= !labels[num1 + i].solid;
+	}
+	if (below && layer) {
+		for(y = 0; y < runs2->h; y++) {
+			joinrows(labels, runs2, y, num1, runs1, y, 0);
+		}
+	}
+	/* parts reaching into layer are kept with a label of it as root */
+	for(i = 0; i < num1 + num2; i++) map[i] = UINT32_MAX;
+	for(i = 0; i < num2; i++) {
+		r = label_find(labels, num1 + i);
+		if (UINT32_MAX == map[r]) {
+			map[r] = i;
+			runs2->labels[i] = labels[r];
+		}
+		runs2->labels[i].parent = map[r];
+	}
+	/* the other parts of below are finished */
+	if (below) {
+		labelmap = &ctx->labelmaps[ctx->numlabelmaps];
+		labelmap->num = num1;
+		labelmap->map = malloc(MAX(1, num1) * sizeof(uint32_t));
+		if (NULL == labelmap->map) {
+			vips_error("imgseq2stl", "can't allocate label maps");
+			ctx->error = 1;
+			num1 = 0;
+		}
+		for(i = 0; i < num1; i++) {
+			r = label_find(labels, i);
+			if (UINT32_MAX == map[r]) {
+				/* empty space in the last layer is outside */
+				if (NULL == layer) labels[r].outside |= !labels[r].solid;
+				map[r] = component_new(ctx, &labels[r]);
+			}
+			labelmap->map[i] = map[r];
+		}
+		ctx->numlabelmaps++;
+		/* only the runs are still needed for tagging */
+		free(runs1->labels);
+		runs1->labels = NULL;
+	} else {
+		ctx->firstz = layer->z;
+	}
+	free(labels);
+	free(map);
+}
+
+/* join the layers with found runs with the layers below, in layer order,
+ * runs in main thread */
+static void joinlayers(struct imgseq2stl *ctx)
+{
+	struct layer *layer;
+	int ready;
+
+	while (NULL != (layer = ctx->joinnext)) {
+		g_mutex_lock(&ctx->lock);
+		ready = layer->runsready;
+		g_mutex_unlock(&ctx->lock);
+		if (0 == ready) break;
+		if (ready < 0) {
+			/* the layer stays in place, later joins with it must not happen */
+			vips_error("imgseq2stl", "can't find the parts of layer %d", layer->z);
+			ctx->error = 1;
+		}
+		if (!ctx->error) joinlayer(ctx, ctx->joined, layer);
+		if (ctx->joined) layer_release(ctx, ctx->joined);
+		ctx->joined = layer;
+		ctx->joinnext = layer->next;
+		layer_release(ctx, layer);
+	}
+}
+
+/* hand triangles of an object to the sink and free the object, they are
+ * held back while connected components are not known yet */
+static void emit(struct imgseq2stl *ctx, struct object *object)
+{
+	struct object *last = *ctx->deferredlast;
+
+	if (!ctx->analysis) {
+		ctx->sink(ctx->userdata, object->triangles, object->free);
+		freeobject(object);
+	} else if (0 == object->free) {
+		freeobject(object);
+	} else if (last && (last->free + object->free <= SINKTRIANGLES)) {
+		/* small results are collected into one object */
+		last = addtriangles(last, object);
+		*ctx->deferredlast = last;
+		if (last->error) ctx->error = 1;
+		freeobject(object);
+	} else {
+		/* big ones are kept as they are, without unused space */
+		object = resize(object, object->free);
+		if (last) ctx->deferredlast = &last->next;
+		*ctx->deferredlast = object;
+	}
+}
+
+/* collect component statistics and hand the held back triangles of all
+ * big enough components facing the outside to the sink, runs in main thread */
+static void emitcomponents(struct imgseq2stl *ctx)
+{
+	struct object *object;
+	struct component *component;
+	uint32_t *map;
+	size_t i, kept, l;
+	int x, y, z, fx, fy, fz;
+
+	/* resolve the label maps top down, labels of the layer above are resolved already */
+	for(l = ctx->numlabelmaps; l-- > 0; ) {
+		map = ctx->labelmaps[l].map;
+		for(i = 0; i < ctx->labelmaps[l].num; i++) {
+			if (!(map[i] & FINISHED)) map[i] = ctx->labelmaps[l+1].map[map[i]];
+			map[i] &= ~FINISHED;
+		}
+	}
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	for(i = 0; i < ctx->numcomponents; i++) {
+		/* empty space has no voxels counted */
+		component = &ctx->components[i];
+		if (0 == component->voxels) continue;
+		ctx->stats.components++;
+		ctx->stats.voxels += component->voxels;
+		ctx->stats.largest = MAX(ctx->stats.largest, component->voxels);
+		if (component->voxels >= ctx->minvoxels) {
+			ctx->stats.kept++;
+		} else {
+			ctx->stats.droppedvoxels += component->voxels;
+		}
+	}
+	/* drop triangles of small components and of enclosed cavities, each
+	 * held back object is freed as soon as it is handed to the sink */
+	while (NULL != (object = ctx->deferred)) {
+		ctx->deferred = object->next;
+		kept = 0;
+		for(i = 0; i < object->free; i++) {
+			triangle_voxels(&object->triangles[i], &x, &y, &z, &fx, &fy, &fz);
+			component = &ctx->components[ctx->labelmaps[z - ctx->firstz].map[object->tags[i].component]];
+			if (component->voxels < ctx->minvoxels) {
+				ctx->stats.droppedtriangles++;
+				continue;
+			}
+			if (ctx->exterior && (UINT32_MAX != object->tags[i].cavity)) {
+				component = &ctx->components[ctx->labelmaps[fz - ctx->firstz].map[object->tags[i].cavity]];
+				if (!component->outside) {
+					ctx->stats.cavitytriangles++;
+					continue;
+				}
+			}
+			object->triangles[kept++] = object->triangles[i];
+		}
+		for(i = 0; i < kept; i += SINKTRIANGLES) {
+			ctx->sink(ctx->userdata, &object->triangles[i], MIN(kept - i, SINKTRIANGLES));
+		}
+		freeobject(object);
+	}
+	ctx->deferredlast = &ctx->deferred;
+	for(l = 0; l < ctx->numlabelmaps; l++) free(ctx->labelmaps[l].map);
+	free(ctx->labelmaps);
+	ctx->labelmaps = NULL;
+	ctx->numlabelmaps = 0;
+	ctx->sizelabelmaps = 0;
+}
+
+/* emit job results in the order the jobs were started, so the output does
+ * not depend on which thread finishes first, runs in main thread */
+static void emitordered(struct imgseq2stl *ctx, unsigned long seq, struct object *object)
+{
+	struct parked **p, *parked;
+
+	parked = malloc(sizeof(struct parked));
+	if (NULL == parked) {
+		vips_error("imgseq2stl", "can't allocate parked result");
+		ctx->error = 1;
+		freeobject(object);
+		return;
+	}
+	parked->seq = seq;
+	parked->object = object;
+	for(p = &ctx->parked; *p && ((*p)->seq < seq); p = &(*p)->next);
+	parked->next = *p;
+	*p = parked;
+	/* emit all results which are next in order */
+	while (ctx->parked && (ctx->parked->seq == ctx->emitseq)) {
+		parked = ctx->parked;
+		ctx->parked = parked->next;
+		emit(ctx, parked->object);
+		free(parked);
+		ctx->emitseq++;
+	}
+}
+
+/* collect results and cleanup after finished job, runs in main thread */
+static void jobs_end(struct imgseq2stl *ctx, struct job *job)
+{
+	int i;
+
+	/* wait for thread to end */
+	(void) g_thread_join(job->id);
+	job->id = NULL;
+	/* deliver triangles, a failed job fails the whole conversion */
+	if (job->object->error) ctx->error = 1;
+	emitordered(ctx, job->seq, job->object);
+	job->object = NULL;
+	/* do reference counting */
+	for(i = 0; i < job->numwork; i++) {
+		if (job->work[i].layer1) layer_release(ctx, job->work[i].layer1);
+		if (job->work[i].layer2) layer_release(ctx, job->work[i].layer2);
+	}
+	/* the runs of more layers may be found now */
+	if (ctx->analysis) joinlayers(ctx);
+	/* short jobs waste time starting threads, long ones leave threads idle at the end */
+	if (ctx->adaptive) {
+		gint64 time = job->time * ctx->batch / job->numwork;
+		if ((time < JOBTIME / 2) && (ctx->batch < MAXBATCH)) ctx->batch *= 2;
+		if ((time > JOBTIME * 2) && (ctx->batch > 1)) ctx->batch /= 2;
+	}
+}
+
+/* wait for a free job, runs in main thread */
+static int jobs_wait(struct imgseq2stl *ctx)
+{
+	int i, j = -1, idle = 0;
+
+	g_mutex_lock(&ctx->lock);
+	while (j < 0) {
+		for(i = 0; i < ctx->threads; i++) {
+			if (ctx->jobs[i].finished) {
+				if (j < 0) j = i;
+				idle++;
+			}
+		}
+		if (j < 0) g_cond_wait(&ctx->cond, &ctx->lock);
+	}
+	ctx->jobs[j].finished = 0;
+	g_mutex_unlock(&ctx->lock);
+	if (ctx->jobs[j].id) {
+		jobs_end(ctx, &ctx->jobs[j]);
+	}
+	/* more than one idle thread means work is handed out too slowly */
+	if (ctx->adaptive && (idle > 1) && (ctx->batch > 1)) ctx->batch /= 2;
+	return j;
+}
+
+/* wait for one running job to end and collect its results, returns -1 if
+ * no job is running, runs in main thread */
+static int jobs_reap(struct imgseq2stl *ctx)
+{
+	int i, j = -1, running = 1;
+
+	g_mutex_lock(&ctx->lock);
+	while ((j < 0) && running) {
+		running = 0;
+		for(i = 0; i < ctx->threads; i++) {
+			if (NULL == ctx->jobs[i].id) continue;
+			running++;
+			if (ctx->jobs[i].finished) j = i;
+		}
+		if ((j < 0) && running) g_cond_wait(&ctx->cond, &ctx->lock);
+	}
+	g_mutex_unlock(&ctx->lock);
+	if (j < 0) return -1;
+	/* the job stays finished, so jobs_wait can hand it out again */
+	jobs_end(ctx, &ctx->jobs[j]);
+	return 0;
+}
+
+/* start the pending job as a new thread, runs in main thread */
+static void jobs_start(struct imgseq2stl *ctx)
+{
+	struct job *job = &ctx->jobs[ctx->pending];
+
+	job->id = vips_g_thread_new("imgseq2stl", &jobs_worker, job);
+	ctx->pending = -1;
+}
+
+/* add work to the pending job, starts it when enough work is collected, runs in main thread */
+static void jobs_new(struct imgseq2stl *ctx, work_t work, int z, struct layer *layer1, struct layer *layer2)
+{
+	struct object *object;
+	struct job *job;
+
+	if (ctx->pending < 0) {
+		object = resize(NULL, 10);
+		if (NULL == object) {
+			/* the work is dropped, but others may wait for its runs */
+			ctx->error = 1;
+			if (work_runs == work) {
+				g_mutex_lock(&ctx->lock);
+				layer1->runsready = -1;
+				g_cond_broadcast(&ctx->runscond);
+				g_mutex_unlock(&ctx->lock);
+			}
+			if (layer1) layer_release(ctx, layer1);
+			if (layer2) layer_release(ctx, layer2);
+			if (ctx->analysis) joinlayers(ctx);
+			return;
+		}
+		ctx->pending = jobs_wait(ctx);
+		ctx->jobs[ctx->pending].object = object;
+		ctx->jobs[ctx->pending].numwork = 0;
+		ctx->jobs[ctx->pending].seq = ctx->jobseq++;
+	}
+	job = &ctx->jobs[ctx->pending];
+	job->work[job->numwork].work = work;
+	job->work[job->numwork].z = z;
+	job->work[job->numwork].layer1 = layer1;
+	job->work[job->numwork].layer2 = layer2;
+	job->numwork++;
+	if (job->numwork >= ctx->batch) jobs_start(ctx);
+}
+
+/* lower cpus to the CPU limit of cgroup directory dir and all its parents,
+ * path is the cgroup below the mount point root and gets shortened */
+static int cgroup_cpus(int cpus, const char *root, char *path, int v2)
+{
+	char name[PATH_MAX];
+	FILE *file;
+	char *p;
+	long long quota, period;
+
+	while (1) {
+		quota = -1;
+		period = 0;
+		if (v2) {
+			/* cgroup v2 has "quota period" or "max period" */
+			snprintf(name, sizeof(name), "%s%s/cpu.max", root, path);
+			file = fopen(name, "r");
+			if (file) {
+				if (2 != fscanf(file, "%lld %lld", &quota, &period)) quota = -1;
+				fclose(file);
+			}
+		} else {
+			/* cgroup v1 has the quota in a separate file, -1 if not limited */
+			snprintf(name, sizeof(name), "%s%s/cpu.cfs_quota_us", root, path);
+			file = fopen(name, "r");
+			if (file) {
+				if (1 != fscanf(file, "%lld", &quota)) quota = -1;
+				fclose(file);
+			}
+			snprintf(name, sizeof(name), "%s%s/cpu.cfs_period_us", root, path);
+			file = fopen(name, "r");
+			if (file) {
+				if (1 != fscanf(file, "%lld", &period)) period = 0;
+				fclose(file);
+			}
+		}
+		if ((quota > 0) && (period > 0)) {
+			cpus = MIN(cpus, (quota + period - 1) / period);
+		}
+		/* a parent group may have a lower limit */
+		p = strrchr(path, '/');
+		if (NULL == p) break;
+		*p = 0;
+	}
+	return cpus;
+}
+
+/* number of CPUs this process can use, honouring affinity and cgroup limits */
+int imgseq2stl_auto_threads(void)
+{
+	FILE *file;
+	char line[PATH_MAX + 64];
+	char *controllers, *path, *p;
+	int found = 0;
+	int cpus;
+
+	/* this honours the CPU affinity mask */
+	cpus = g_get_num_processors();
+	/* lines are "id:controllers:path", cgroup v2 is "0::path" */
+	file = fopen("/proc/self/cgroup", "r");
+	if (file) {
+		while (fgets(line, sizeof(line), file)) {
+			line[strcspn(line, "\n")] = 0;
+			controllers = strchr(line, ':');
+			if (NULL == controllers) continue;
+			*controllers++ = 0;
+			path = strchr(controllers, ':');
+			if (NULL == path) continue;
+			*path++ = 0;
+			if (0 == strcmp(path, "/")) path[0] = 0;
+			if ((0 == strcmp(line, "0")) && (0 == controllers[0])) {
+				cpus = cgroup_cpus(cpus, "/sys/fs/cgroup", path, 1);
+				found = 1;
+			} else {
+				/* v1 controllers are a list like "cpu,cpuacct" */
+				for(p = strtok(controllers, ","); p; p = strtok(NULL, ",")) {
+					if (0 == strcmp(p, "cpu")) {
+						cpus = cgroup_cpus(cpus, "/sys/fs/cgroup/cpu", path, 0);
+						found = 1;
+					}
+				}
+			}
+		}
+		fclose(file);
+	}
+	if (!found) {
+		/* no /proc, try the root groups */
+		line[0] = 0;
+		cpus = cgroup_cpus(cpus, "/sys/fs/cgroup", line, 1);
+		cpus = cgroup_cpus(cpus, "/sys/fs/cgroup/cpu", line, 0);
+	}
+	return MAX(1, cpus);
+}
+
+/* create a converter, returns NULL on error */
+struct imgseq2stl *imgseq2stl_new(int threads, imgseq2stl_sink_t sink, void *userdata)
+{
+	struct imgseq2stl *ctx;
+
+	int i;
+
+	if ((threads < 0) || (NULL == sink)) return NULL;
+	if (VIPS_INIT("imgseq2stl")) return NULL;
+	ctx = calloc(1, sizeof(struct imgseq2stl));
+	if (NULL == ctx) return NULL;
+	if (0 == threads) {
+		/* automatic threads, job size adapts to the measured run time */
+		threads = imgseq2stl_auto_threads();
+		ctx->adaptive = 1;
+	}
+	ctx->jobs = calloc(threads, sizeof(struct job));
+	if (NULL == ctx->jobs) {
+		free(ctx);
+		return NULL;
+	}
+	for(i = 0; i < threads; i++) {
+		ctx->jobs[i].ctx = ctx;
+		ctx->jobs[i].finished = 1;
+	}
+	g_mutex_init(&ctx->lock);
+	g_cond_init(&ctx->cond);
+	g_cond_init(&ctx->runscond);
+	ctx->threads = threads;
+	ctx->maxlayers = LAYERSPERTHREAD * threads + 2;
+	ctx->batch = 1;
+	ctx->pending = -1;
+	ctx->sink = sink;
+	ctx->userdata = userdata;
+	ctx->deferredlast = &ctx->deferred;
+	return ctx;
+}
+
+/* prepare connected component analysis, returns -1 if layers were pushed already */
+static int startcomponents(struct imgseq2stl *ctx)
+{
+	if (ctx->last || ctx->joined) {
+		vips_error("imgseq2stl", "component analysis must be enabled before the first layer");
+		return -1;
+	}
+	ctx->analysis = 1;
+	return 0;
+}
+
+/* enable connected component analysis, runs in main thread */
+int imgseq2stl_set_min_component_voxels(struct imgseq2stl *ctx, uint64_t minvoxels)
+{
+	if ((0 == minvoxels) || (startcomponents(ctx) < 0)) return -1;
+	ctx->minvoxels = minvoxels;
+	return 0;
+}
+
+/* enable exterior analysis, runs in main thread */
+int imgseq2stl_set_exterior_only(struct imgseq2stl *ctx)
+{
+	if (startcomponents(ctx) < 0) return -1;
+	ctx->exterior = 1;
+	return 0;
+}
+
+/* add the next layer image, runs in main thread */
+int imgseq2stl_push_image(struct imgseq2stl *ctx, int z, VipsImage *image)
+{
+	struct layer *layer;
+
+	if (ctx->error) {
+		vips_error("imgseq2stl", "an earlier layer has failed");
+		g_object_unref(image);
+		return -1;
+	}
+	if (ctx->last) {
+		if (z != ctx->last->z + 1) {
+			vips_error("imgseq2stl", "layer %d does not follow layer %d", z, ctx->last->z);
+			g_object_unref(image);
+			return -1;
+		}
+		if ((vips_image_get_width(image) != vips_image_get_width(ctx->last->image)) ||
+		    (vips_image_get_height(image) != vips_image_get_height(ctx->last->image))) {
+			vips_error("imgseq2stl", "layer %d has a different size", z);
+			g_object_unref(image);
+			return -1;
+		}
+	}
+	/* keep the number of open layers bounded, whatever the batch size is */
+	while (ctx->numlayers >= ctx->maxlayers) {
+		if (ctx->pending >= 0) jobs_start(ctx);
+		if (jobs_reap(ctx) < 0) break;
+	}
+	layer = calloc(1, sizeof(struct layer));
+	if (NULL == layer) {
+		vips_error("imgseq2stl", "can't allocate layer");
+		g_object_unref(image);
+		return -1;
+	}
+	layer->image = image;
+	layer->z = z;
+	/* bottom or z, front back left right x y, z or top of the next layer,
+	 * with analysis also the runs and joining with the layers around */
+	layer->users = ctx->analysis ? 6 : 3;
+	ctx->numlayers++;
+	if (ctx->last) ctx->last->next = layer;
+	if (ctx->analysis) {
+		if (NULL == ctx->joinnext) ctx->joinnext = layer;
+		/* the work below waits for the runs */
+		jobs_new(ctx, work_runs, z, layer, NULL);
+	}
+	if (NULL == ctx->last) {
+		/* first layer needs to have bottom added */
+		jobs_new(ctx, work_bottom, z, layer, NULL);
+	} else {
+		/* rest of the layers need z added */
+		jobs_new(ctx, work_z, z, layer, ctx->last);
+	}
+	/* combine all jobs which need only one image */
+	jobs_new(ctx, work_fblrxy, z, layer, NULL);
+	ctx->last = layer;
+	return 0;
+}
+
+/* add the next layer from a pixel buffer, runs in main thread */
+int imgseq2stl_push_layer(struct imgseq2stl *ctx, int z, const uint8_t *buffer, int width, int height)
+{
+	VipsImage *image;
+
+	image = vips_image_new_from_memory_copy(buffer, (size_t) width * height, width, height, 1, VIPS_FORMAT_UCHAR);
+	if (NULL == image) return -1;
+	return imgseq2stl_push_image(ctx, z, image);
+}
+
+/* add top surface and collect all remaining jobs, runs in main thread */
+int imgseq2stl_finish(struct imgseq2stl *ctx)
+{
+	struct object *object;
+	int i;
+
+	/* start the last collected work */
+	if (ctx->pending >= 0) jobs_start(ctx);
+	/* wait for all threads to end and collect results */
+	for(i = 0; i < ctx->threads; i++) {
+		if (ctx->jobs[i].id) {
+			jobs_end(ctx, &ctx->jobs[i]);
+		}
+		ctx->jobs[i].finished = 1;
+	}
+	/* all runs are found, so all layers are joined now */
+	if (ctx->last) {
+		/* last layer needs top added, after all jobs to keep the output order */
+		object = resize(NULL, 1024);
+		if (NULL == object) {
+			ctx->error = 1;
+		} else {
+			object = addtop(object, ctx->last->image, ctx->last->z);
+			if (object->error) ctx->error = 1;
+			if (ctx->analysis && !ctx->error) tagtriangles(object, 0, ctx->last, NULL);
+			if (object->error) ctx->error = 1;
+			emit(ctx, object);
+		}
+		layer_release(ctx, ctx->last);
+		ctx->last = NULL;
+	}
+	if (ctx->joined) {
+		/* all parts of the last layer are finished */
+		if (!ctx->error) joinlayer(ctx, ctx->joined, NULL);
+		layer_release(ctx, ctx->joined);
+		ctx->joined = NULL;
+	}
+	/* all components are known now, unless a layer has failed */
+	if (ctx->labelmaps && !ctx->error) emitcomponents(ctx);
+	return ctx->error ? -1 : 0;
+}
+
+/* get connected component statistics */
+int imgseq2stl_get_components(struct imgseq2stl *ctx, struct imgseq2stl_components *stats)
+{
+	if ((0 == ctx->minvoxels) && !ctx->exterior) return -1;
+	*stats = ctx->stats;
+	return 0;
+}
+
+/* free the converter */
+void imgseq2stl_free(struct imgseq2stl *ctx)
+{
+	struct object *object;
+	size_t i;
+
+	if (NULL == ctx) return;
+	imgseq2stl_finish(ctx);
+	while (NULL != (object = ctx->deferred)) {
+		ctx->deferred = object->next;
+		freeobject(object);
+	}
+	for(i = 0; i < ctx->numlabelmaps; i++) free(ctx->labelmaps[i].map);
+	free(ctx->labelmaps);
+	free(ctx->components);
+	g_mutex_clear(&ctx->lock);
+	g_cond_clear(&ctx->cond);
+	g_cond_clear(&ctx->runscond);
+	free(ctx->jobs);
+	free(ctx);
+}
@@ -0,0 +1,97 @@
+#!/usr/bin/perl -w
+
+# write a small test volume with enclosed cavities and islands, as one PGM
+# file per layer, as one raw file and as one multi-page TIFF with all layers
+
+use strict;
+
+my $dir = shift || ".";
+my ($w, $h, $d) = (24, 24, 16);
+my @voxels = ();
+
+# set all voxels of a box to solid (1) or empty (0)
+sub box {
+	my ($x0, $y0, $z0, $x1, $y1, $z1, $solid) = @_;
+	for my $z ($z0 .. $z1) {
+		for my $y ($y0 .. $y1) {
+			for my $x ($x0 .. $x1) {
+				$voxels[$z][$y][$x] = $solid;
+			}
+		}
+	}
+}
+
+box(0, 0, 0, $w - 1, $h - 1, $d - 1, 0);
+# hollow box with an island in its cavity
+box(2, 2, 1, 9, 9, 8, 1);
+box(4, 4, 3, 7, 7, 6, 0);
+box(5, 5, 4, 5, 5, 4, 1);
+# block with a U shaped cavity, the two arms only meet at the top
+box(12, 2, 2, 21, 11, 11, 1);
+box(14, 4, 4, 15, 5, 8, 0);
+box(18, 4, 4, 19, 5, 8, 0);
+box(14, 4, 8, 19, 5, 8, 0);
+# and a tunnel through it, which is not enclosed
+box(12, 8, 6, 21, 9, 7, 0);
+# two pillars only joined at the top
+box(2, 14, 0, 3, 15, 12, 1);
+box(8, 14, 0, 9, 15, 12, 1);
+box(2, 14, 12, 9, 15, 12, 1);
+# ring in the last layers, the hole is open to the top
+box(12, 14, 14, 16, 18, 15, 1);
+box(14, 16, 15, 14, 16, 15, 0);
+# islands of one and two voxels, in the first layer and at the side
+box(22, 22, 10, 22, 22, 10, 1);
+box(20, 20, 0, 20, 20, 0, 1);
+box(16, 21, 12, 16, 21, 13, 1);
+box(0, 23, 5, 0, 23, 5, 1);
+
+# TIFF directory entry of one short or long value
+sub entry {
+	my ($tag, $value, $long) = @_;
+	return $long ? pack("vvVV", $tag, 4, 1, $value) : pack("vvVvv", $tag, 3, 1, $value, 0);
+}
+
+# uncompressed little endian TIFF, every page is its pixels and its directory
+my $tiff = pack("a4V", "II*\0", 0);
+my $next = 4; # where to link the next directory
+
+open(RAW, ">", "$dir/volume.raw") || die "Can't write $dir/volume.raw";
+binmode(RAW);
+for my $z (0 .. $d - 1) {
+	my $pixels = "";
+	for my $y (0 .. $h - 1) {
+		for my $x (0 .. $w - 1) {
+			$pixels .= chr($voxels[$z][$y][$x] ? 255 : 0);
+		}
+	}
+	my $name = sprintf("%s/layer-%03d.pgm", $dir, $z);
+	open(PGM, ">", $name) || die "Can't write $name";
+	binmode(PGM);
+	print PGM "P5\n$w $h\n255\n", $pixels;
+	close(PGM);
+	print RAW $pixels;
+	my $offset = length($tiff);
+	$tiff .= $pixels;
+	substr($tiff, $next, 4) = pack("V", length($tiff));
+	$tiff .= pack("v", 11) .
+		entry(254, 2, 1) .		# page of a multi-page image
+		entry(256, $w) .		# width
+		entry(257, $h) .		# height
+		entry(258, 8) .			# bits per sample
+		entry(259, 1) .			# no compression
+		entry(262, 1) .			# black is zero
+		entry(273, $offset, 1) .	# strip offset
+		entry(277, 1) .			# samples per pixel
+		entry(278, $h) .		# rows per strip
+		entry(279, $w * $h, 1) .	# strip bytes
+		entry(284, 1);			# planar configuration
+	$next = length($tiff);
+	$tiff .= pack("V", 0);
+}
+close(RAW);
+
+open(TIFF, ">", "$dir/volume.tif") || die "Can't write $dir/volume.tif";
+binmode(TIFF);
+print TIFF $tiff;
+close(TIFF);
@@ -0,0 +1,64 @@
+#!/bin/sh
+# end to end test of imgseq2stl on a small volume, run by "make test"
+
+cd `dirname $0` || exit 1
+rm -rf out
+mkdir out || exit 1
+perl mkvolume.pl out || exit 1
+failed=0
+
+# convert the volume into out/<name>/object.stl, so all results have the same solid name
+convert() {
+	name=$1
+	shift
+	mkdir out/$name
+	if ! (cd out/$name && ../../../imgseq2stl --output object.stl --first 0 --last 15 "$@" 2>log); then
+		echo "$name: imgseq2stl failed, see out/$name/log"
+		failed=1
+	fi
+}
+
+# compare the canonical form of a result with a reference
+check() {
+	if ! perl ../canonstl.pl out/$2 | cmp -s - $1; then
+		echo "$2: differs from $1"
+		failed=1
+	fi
+}
+
+# compare two results byte by byte, they must have the triangles in the same order
+same() {
+	if ! cmp -s out/$1 out/$2; then
+		echo "$2: differs from $1"
+		failed=1
+	fi
+}
+
+for threads in 1 3 auto; do
+	convert pattern-$threads --threads $threads --input ../layer-%03d.pgm
+	convert raw-$threads --threads $threads --input ../volume.raw --raw 24x24
+	convert pages-$threads --threads $threads --input ../volume.tif --pages
+	convert gzip-$threads --threads $threads --input ../layer-%03d.pgm --compress gzip
+	zcat < out/gzip-$threads/object.stl > out/gzip-$threads/unzipped.stl
+	convert zstd-$threads --threads $threads --input ../layer-%03d.pgm --compress zstd
+	zstdcat < out/zstd-$threads/object.stl > out/zstd-$threads/unzipped.stl
+	convert exterior-$threads --threads $threads --input ../layer-%03d.pgm --exterior-only --min-component-voxels 3
+	check reference.txt pattern-$threads/object.stl
+	check reference.txt raw-$threads/object.stl
+	check reference.txt pages-$threads/object.stl
+	check reference.txt gzip-$threads/unzipped.stl
+	check reference.txt zstd-$threads/unzipped.stl
+	check reference-exterior.txt exterior-$threads/object.stl
+	same pattern-1/object.stl pattern-$threads/object.stl
+	same pattern-1/object.stl raw-$threads/object.stl
+	same pattern-1/object.stl pages-$threads/object.stl
+	same pattern-1/object.stl gzip-$threads/unzipped.stl
+	same pattern-1/object.stl zstd-$threads/unzipped.stl
+	same exterior-1/object.stl exterior-$threads/object.stl
+done
+
+if [ $failed != 0 ]; then
+	echo "tests FAILED"
+	exit 1
+fi
+echo "all tests passed"